@@ -13,7 +13,6 @@ import (
 	"os"
 	"os/signal"
 	"syscall"
-	"time"
 )
 
 func main() {
@@ -27,8 +26,6 @@ func main() {
 	}()
 	fmt.Fprintf(os.Stdout, "info: Waiting for debug attachment (pid=%d)...\n",
 		os.Getpid())
-	for !aegis.HasDebugger() {
-		time.Sleep(1 * time.Nanosecond)
-	}
+	aegis.WaitForDebugger(aegis.WaitForever)
 	fmt.Fprintf(os.Stdout, "\rinfo: Debug detected. Go home!\n")
 }
@@ -12,7 +12,13 @@ package aegis
 #cgo CFLAGS:  -I../../src -DCGO=1
 #include <aegis.h>
 #include <aegis.c>
+#cgo linux LDFLAGS: -lrt -lpthread
 #if defined(__linux__)
+# include <native/linux/aegis_procfs.c>
+# include <native/linux/aegis_daemon.c>
+# include <native/linux/aegis_config.c>
+# include <native/linux/aegis_selftrap.c>
+# include <native/linux/aegis_ancestry.c>
 # include <native/linux/aegis_native.c>
 #elif defined(__FreeBSD__)
 # include <native/freebsd/aegis_native.c>
@@ -12,7 +12,14 @@ package aegis
 #cgo CFLAGS:  -I../../src -DCGO=1
 #include <aegis.h>
 #include <aegis.c>
+#cgo linux LDFLAGS: -lrt -lpthread
+#cgo windows LDFLAGS: -lfltlib
 #if defined(__linux__)
+# include <native/linux/aegis_procfs.c>
+# include <native/linux/aegis_daemon.c>
+# include <native/linux/aegis_config.c>
+# include <native/linux/aegis_selftrap.c>
+# include <native/linux/aegis_ancestry.c>
 # include <native/linux/aegis_native.c>
 #elif defined(__FreeBSD__)
 # include <native/freebsd/aegis_native.c>
@@ -21,7 +28,6 @@ package aegis
 #elif defined(__OpenBSD__)
 # include <native/openbsd/aegis_native.c>
 #elif defined(_WIN32)
-#cgo LDFLAGS: -lfltlib
 # include <native/windows/aegis_native.c>
 #endif
 */
@@ -44,6 +50,20 @@ func HasDebugger() bool {
 	return (C.aegis_has_debugger() == 1)
 }
 
+// WaitForever is the timeout that makes WaitForDebugger wait until a debugger shows up, no matter how long it takes.
+const WaitForever time.Duration = -1
+
+// WaitForDebugger is a Go wrapper for aegis_wait_for_debugger() from libaegis. WaitForDebugger blocks (sleeping, not
+// spinning) until a debugger is attached or timeout expires. It returns true when a debugger was detected and false
+// when it gave up due to timeout. A negative timeout (WaitForever) means no timeout at all.
+func WaitForDebugger(timeout time.Duration) bool {
+	timeoutMs := -1
+	if timeout >= 0 {
+		timeoutMs = int(timeout / time.Millisecond)
+	}
+	return (C.aegis_wait_for_debugger(C.int(timeoutMs)) == 1)
+}
+
 // SetGorgon is a Go native implementation of aegis_set_gorgon(). This function installs a goroutine responsible for watching
 // out a debugging attempt. The argument exitFunc is a function that verifies if it is time to gracefully exiting. Its
 // arguments is the 'generic' argument exitFuncArgs. The argument onDebuggerFunc is a function that takes some action when a
@@ -561,6 +561,19 @@ func TestSetGorgon(t *testing.T) {
 	}
 }
 
+func TestWaitForDebugger(t *testing.T) {
+	if WaitForDebugger(0) {
+		t.Error(`WaitForDebugger(0) == true`)
+	}
+	start := time.Now()
+	if WaitForDebugger(2 * time.Second) {
+		t.Error(`WaitForDebugger(2 * time.Second) == true`)
+	}
+	if time.Since(start) < 1*time.Second {
+		t.Error(`WaitForDebugger(2 * time.Second) has not waited`)
+	}
+}
+
 func hasDebuggerOpenBSD() bool {
 	const kBacalhuffy = `rm out.txt > /dev/null 2>&1
 ../../samples/golang-wait4debug > out.txt &
@@ -5,10 +5,42 @@
  * This source code is licensed under the BSD-style license found in the
  * LICENSE file in the root directory of this source tree.
  */
+#include <aegis.h>
 #include <stdlib.h>
 #include <unistd.h>
+#if defined(_WIN32)
+# include <windows.h>
+#elif !defined(__linux__)
+# include <time.h>
+#endif
 
 void aegis_default_on_debugger(void *args) {
     exit(1);
 }
 
+#if !defined(__linux__)
+
+#define AEGIS_WAIT_PROBE_INTERVAL_MSECS 10
+
+// INFO(Rafael): Linux has its own event driven implementation, here we only avoid
+//               pegging a core by sleeping between probes.
+int aegis_wait_for_debugger(const int timeout_ms) {
+    int elapsed_ms = 0;
+#if !defined(_WIN32)
+    struct timespec probe_interval = { 0, AEGIS_WAIT_PROBE_INTERVAL_MSECS * 1000000L };
+#endif
+    while (!aegis_has_debugger()) {
+        if (timeout_ms >= 0 && elapsed_ms >= timeout_ms) {
+            return 0;
+        }
+#if defined(_WIN32)
+        Sleep(AEGIS_WAIT_PROBE_INTERVAL_MSECS);
+#else
+        nanosleep(&probe_interval, NULL);
+#endif
+        elapsed_ms += AEGIS_WAIT_PROBE_INTERVAL_MSECS;
+    }
+    return 1;
+}
+
+#endif // !defined(__linux__)
@@ -8,8 +8,19 @@
 #ifndef AEGIS_H
 #define AEGIS_H 1
 
+#include <stddef.h>
+
 #define AEGIS_VERSION "v2"
 
+#define AEGIS_GORGON_SLEEP_WHEN_IDLE ((unsigned int)-1)
+
+struct aegis_probe_stats {
+    unsigned long long last_nsecs;
+    unsigned long long max_nsecs;
+    unsigned long long total_nsecs;
+    unsigned long long probes_nr;
+};
+
 #if !defined(CGO)
 typedef int (*aegis_gorgon_exit_test_func)(void *args);
 typedef void (*aegis_gorgon_on_debugger_func)(void *args);
@@ -18,8 +29,96 @@ void aegis_default_on_debugger(void *args);
 
 int aegis_set_gorgon(aegis_gorgon_exit_test_func exit_test, void *exit_test_args,
                      aegis_gorgon_on_debugger_func on_debugger, void *on_debugger_args);
+
+int aegis_set_gorgon_probe_rate(const unsigned int active_usecs, const unsigned int idle_usecs);
+
+void aegis_protect_begin(void);
+
+void aegis_protect_end(void);
+
+void aegis_wake_gorgon(void);
+
+#if !defined(_WIN32)
+void aegis_get_gorgon_stats(struct aegis_probe_stats *stats);
+
+struct aegis_wipe_stats {
+    unsigned long long last_nsecs;
+    unsigned long long max_nsecs;
+    unsigned long long wiped_bytes;
+    unsigned long long wipes_nr;
+};
+
+int aegis_register_secret(void *data, const size_t data_size);
+
+int aegis_unregister_secret(void *data);
+
+int aegis_set_wipe_workers(const unsigned int workers_nr);
+
+void aegis_wipe_secrets(void);
+
+void aegis_get_wipe_stats(struct aegis_wipe_stats *stats);
+
+struct aegis_heartbeat;
+
+struct aegis_heartbeat *aegis_heartbeat_register(const unsigned int stall_usecs);
+
+void aegis_heartbeat_unregister(struct aegis_heartbeat *heartbeat);
+
+void aegis_heartbeat_beat(struct aegis_heartbeat *heartbeat);
+
+int aegis_set_heartbeat_monitors(const unsigned int monitors_nr, const unsigned int period_usecs,
+                                 aegis_gorgon_on_debugger_func on_stall, void *on_stall_args);
+
+int aegis_stop_heartbeat_monitors(void);
+
+#define AEGIS_DISPATCH_SYNC  0
+#define AEGIS_DISPATCH_ASYNC 1
+
+struct aegis_dispatch_stats {
+    unsigned long long last_nsecs;
+    unsigned long long max_nsecs;
+    unsigned long long total_nsecs;
+    unsigned long long dispatches_nr;
+    unsigned long long coalesced_nr;
+    unsigned long long dropped_nr;
+};
+
+int aegis_set_gorgon_dispatch(const int mode, const size_t responder_stack_size);
+
+void aegis_get_dispatch_stats(struct aegis_dispatch_stats *stats);
+
+void aegis_rearm(void);
+#endif // !defined(_WIN32)
 #endif // !defined(CGO)
 
 int aegis_has_debugger(void);
 
+#define AEGIS_WAIT_FOREVER -1
+
+int aegis_wait_for_debugger(const int timeout_ms);
+
+#if defined(__linux__)
+#define AEGIS_CONFIG_ENV "AEGIS_CONFIG"
+
+#define AEGIS_HEURISTIC_PROCFS   0x1
+#define AEGIS_HEURISTIC_SELFTRAP 0x2
+#define AEGIS_HEURISTIC_ANCESTRY 0x4
+
+#define AEGIS_HEURISTICS_ALL (AEGIS_HEURISTIC_PROCFS | AEGIS_HEURISTIC_SELFTRAP | AEGIS_HEURISTIC_ANCESTRY)
+
+int aegis_set_heuristics(const unsigned int heuristics);
+
+void aegis_get_selftrap_stats(struct aegis_probe_stats *stats);
+
+#define AEGIS_PROCFS_DEFAULT_ROOT "/proc"
+
+int aegis_set_procfs_root(const char *root);
+
+#define AEGIS_DAEMON_DEFAULT_SOCKET "/var/run/aegisd.sock"
+
+int aegis_daemon_attach(const char *socket_path);
+
+void aegis_daemon_detach(void);
+#endif // defined(__linux__)
+
 #endif
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#if !defined(_GNU_SOURCE)
+# define _GNU_SOURCE 1
+#endif
+#include <aegis.h>
+#include <native/linux/aegis_board.h>
+#include <native/linux/aegis_procfs.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#define AEGISD_DEFAULT_INTERVAL_USECS "1000"
+
+struct aegisd_client {
+    pid_t pid;
+    int slot;
+    uint32_t verdict;
+};
+
+struct aegisd_ctx {
+    const char *socket_path;
+    const char *board_name;
+    uint64_t interval_nsecs;
+    int listenfd;
+    struct aegis_board *board;
+    struct pollfd fds[AEGIS_BOARD_SLOTS_NR + 1];
+    struct aegisd_client clients[AEGIS_BOARD_SLOTS_NR + 1];
+    nfds_t fds_nr;
+    unsigned char slot_in_use[AEGIS_BOARD_SLOTS_NR];
+};
+
+static struct aegisd_ctx g_aegisd;
+
+static volatile sig_atomic_t g_aegisd_stop = 0;
+
+static void aegisd_sigint_watchdog(int signo);
+
+static const char *get_option(const int argc, char **argv, const char *option, const char *default_value);
+
+static int aegisd_init(void);
+
+static void aegisd_finis(void);
+
+static void aegisd_loop(void);
+
+static void aegisd_accept(void);
+
+static void aegisd_register(const nfds_t c);
+
+static void aegisd_unregister(const nfds_t c);
+
+static void aegisd_sweep(void);
+
+int main(int argc, char **argv) {
+    long interval_usecs;
+
+    if (get_option(argc, argv, "--help", NULL) != NULL) {
+        fprintf(stdout, "use: %s [--socket=<path>] [--board=<shm-name>] [--interval=<usecs>] "
+                        "[--procfs-root=<path>]\n", argv[0]);
+        return 0;
+    }
+
+    g_aegisd.socket_path = get_option(argc, argv, "--socket", AEGIS_DAEMON_DEFAULT_SOCKET);
+    g_aegisd.board_name = get_option(argc, argv, "--board", AEGIS_BOARD_DEFAULT_NAME);
+    interval_usecs = atol(get_option(argc, argv, "--interval", AEGISD_DEFAULT_INTERVAL_USECS));
+
+    if (interval_usecs <= 0) {
+        fprintf(stderr, "error: --interval must be a positive number of microseconds.\n");
+        return 1;
+    }
+
+    if (strlen(g_aegisd.board_name) >= AEGIS_BOARD_NAME_SIZE || g_aegisd.board_name[0] != '/') {
+        fprintf(stderr, "error: --board must be a shared memory name like '/name' with less than %d bytes.\n",
+                AEGIS_BOARD_NAME_SIZE);
+        return 1;
+    }
+
+    if (aegis_set_procfs_root(get_option(argc, argv, "--procfs-root", AEGIS_PROCFS_DEFAULT_ROOT)) != 0) {
+        fprintf(stderr, "error: invalid --procfs-root.\n");
+        return 1;
+    }
+
+    g_aegisd.interval_nsecs = (uint64_t)interval_usecs * 1000ULL;
+
+    signal(SIGINT, aegisd_sigint_watchdog);
+    signal(SIGTERM, aegisd_sigint_watchdog);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (aegisd_init() != 0) {
+        aegisd_finis();
+        return 1;
+    }
+
+    fprintf(stdout, "info: aegisd is watching on '%s' (board='%s', interval=%ld usecs, pid=%d).\n",
+            g_aegisd.socket_path, g_aegisd.board_name, interval_usecs, getpid());
+
+    aegisd_loop();
+
+    aegisd_finis();
+
+    fprintf(stdout, "info: aegisd has exited.\n");
+
+    return 0;
+}
+
+static void aegisd_sigint_watchdog(int signo) {
+    g_aegisd_stop = 1;
+}
+
+static const char *get_option(const int argc, char **argv, const char *option, const char *default_value) {
+    size_t option_size = strlen(option);
+    int a;
+    for (a = 1; a < argc; a++) {
+        if (strncmp(argv[a], option, option_size) == 0) {
+            if (argv[a][option_size] == '=') {
+                return &argv[a][option_size + 1];
+            } else if (argv[a][option_size] == 0) {
+                return argv[a];
+            }
+        }
+    }
+    return default_value;
+}
+
+static int aegisd_init(void) {
+    struct sockaddr_un addr;
+    int shmfd;
+    uint64_t stale_nsecs;
+
+    g_aegisd.listenfd = -1;
+    g_aegisd.board = MAP_FAILED;
+
+    if (strlen(g_aegisd.socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: socket path is too long.\n");
+        return 1;
+    }
+
+    shm_unlink(g_aegisd.board_name);
+
+    if ((shmfd = shm_open(g_aegisd.board_name, O_CREAT | O_EXCL | O_RDWR, 0644)) == -1) {
+        perror("error: unable to create board");
+        return 1;
+    }
+
+    fchmod(shmfd, 0644);
+
+    if (ftruncate(shmfd, sizeof(struct aegis_board)) != 0) {
+        perror("error: unable to size board");
+        close(shmfd);
+        return 1;
+    }
+
+    g_aegisd.board = mmap(NULL, sizeof(struct aegis_board), PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+    close(shmfd);
+
+    if (g_aegisd.board == MAP_FAILED) {
+        perror("error: unable to map board");
+        return 1;
+    }
+
+    stale_nsecs = g_aegisd.interval_nsecs * 10;
+    if (stale_nsecs < AEGIS_BOARD_MIN_STALE_NSECS) {
+        stale_nsecs = AEGIS_BOARD_MIN_STALE_NSECS;
+    }
+
+    g_aegisd.board->version = AEGIS_BOARD_VERSION;
+    g_aegisd.board->slots_nr = AEGIS_BOARD_SLOTS_NR;
+    g_aegisd.board->daemon_pid = getpid();
+    g_aegisd.board->stale_nsecs = stale_nsecs;
+    __atomic_store_n(&g_aegisd.board->heartbeat, aegis_board_now(), __ATOMIC_RELEASE);
+    __atomic_store_n(&g_aegisd.board->magic, AEGIS_BOARD_MAGIC, __ATOMIC_RELEASE);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, g_aegisd.socket_path, sizeof(addr.sun_path) - 1);
+
+    unlink(g_aegisd.socket_path);
+
+    if ((g_aegisd.listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1 ||
+        bind(g_aegisd.listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(g_aegisd.socket_path, 0666) != 0 ||
+        listen(g_aegisd.listenfd, SOMAXCONN) != 0) {
+        perror("error: unable to listen");
+        return 1;
+    }
+
+    g_aegisd.fds[0].fd = g_aegisd.listenfd;
+    g_aegisd.fds[0].events = POLLIN;
+    g_aegisd.fds_nr = 1;
+
+    return 0;
+}
+
+static void aegisd_finis(void) {
+    nfds_t c;
+
+    for (c = 1; c < g_aegisd.fds_nr; c++) {
+        close(g_aegisd.fds[c].fd);
+    }
+
+    g_aegisd.fds_nr = 0;
+
+    if (g_aegisd.listenfd != -1) {
+        close(g_aegisd.listenfd);
+        unlink(g_aegisd.socket_path);
+        g_aegisd.listenfd = -1;
+    }
+
+    if (g_aegisd.board != MAP_FAILED) {
+        __atomic_store_n(&g_aegisd.board->heartbeat, 0, __ATOMIC_RELEASE);
+        munmap(g_aegisd.board, sizeof(struct aegis_board));
+        g_aegisd.board = MAP_FAILED;
+        shm_unlink(g_aegisd.board_name);
+    }
+}
+
+static void aegisd_loop(void) {
+    uint64_t next_sweep = aegis_board_now(), now;
+    struct timespec timeout;
+    nfds_t c;
+
+    while (!g_aegisd_stop) {
+        now = aegis_board_now();
+
+        if (now >= next_sweep) {
+            aegisd_sweep();
+            next_sweep += g_aegisd.interval_nsecs;
+            if (next_sweep <= now) {
+                next_sweep = now + g_aegisd.interval_nsecs;
+            }
+            continue;
+        }
+
+        timeout.tv_sec = (next_sweep - now) / 1000000000ULL;
+        timeout.tv_nsec = (next_sweep - now) % 1000000000ULL;
+
+        if (ppoll(g_aegisd.fds, g_aegisd.fds_nr, &timeout, NULL) <= 0) {
+            continue;
+        }
+
+        // INFO(Rafael): Walking backwards because unregistering moves the last client into the freed position.
+        for (c = g_aegisd.fds_nr - 1; c > 0; c--) {
+            if (g_aegisd.fds[c].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                aegisd_unregister(c);
+            } else if (g_aegisd.fds[c].revents & POLLIN) {
+                aegisd_register(c);
+            }
+        }
+
+        if (g_aegisd.fds[0].revents & POLLIN) {
+            aegisd_accept();
+        }
+    }
+}
+
+static void aegisd_accept(void) {
+    int fd;
+    while ((fd = accept4(g_aegisd.listenfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+        if (g_aegisd.fds_nr == AEGIS_BOARD_SLOTS_NR + 1) {
+            // INFO(Rafael): Left in the backlog it would keep the listener readable and us spinning.
+            close(fd);
+            continue;
+        }
+        g_aegisd.fds[g_aegisd.fds_nr].fd = fd;
+        g_aegisd.fds[g_aegisd.fds_nr].events = POLLIN;
+        g_aegisd.fds[g_aegisd.fds_nr].revents = 0;
+        g_aegisd.clients[g_aegisd.fds_nr].pid = 0;
+        g_aegisd.clients[g_aegisd.fds_nr].slot = -1;
+        g_aegisd.clients[g_aegisd.fds_nr].verdict = 0;
+        g_aegisd.fds_nr++;
+    }
+}
+
+static void aegisd_register(const nfds_t c) {
+    struct aegisd_client *client = &g_aegisd.clients[c];
+    struct aegis_board_hello hello;
+    struct aegis_board_reply reply;
+    struct ucred cred;
+    socklen_t cred_size = sizeof(cred);
+    struct aegis_board_slot *slot;
+    uint32_t generation;
+    int s;
+
+    if (recv(g_aegisd.fds[c].fd, &hello, sizeof(hello), 0) != sizeof(hello) || client->slot != -1 ||
+        hello.magic != AEGIS_BOARD_MAGIC || hello.version != AEGIS_BOARD_VERSION ||
+        getsockopt(g_aegisd.fds[c].fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size) != 0) {
+        aegisd_unregister(c);
+        return;
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    reply.magic = AEGIS_BOARD_MAGIC;
+    reply.status = 1;
+
+    for (s = 0; s < AEGIS_BOARD_SLOTS_NR && g_aegisd.slot_in_use[s]; s++)
+        ;
+
+    if (s < AEGIS_BOARD_SLOTS_NR) {
+        // INFO(Rafael): Never trust in a pid told by the client, the kernel tells the truth.
+        slot = &g_aegisd.board->slots[s];
+        generation = slot->generation + 1;
+        client->pid = cred.pid;
+        client->slot = s;
+        client->verdict = (uint32_t)aegis_procfs_has_tracer(client->pid);
+        aegis_board_slot_write(slot, client->pid, client->verdict, generation);
+        g_aegisd.slot_in_use[s] = 1;
+        reply.status = 0;
+        reply.slot = (uint32_t)s;
+        reply.generation = generation;
+        strncpy(reply.board_name, g_aegisd.board_name, sizeof(reply.board_name) - 1);
+    }
+
+    if (send(g_aegisd.fds[c].fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply) || reply.status != 0) {
+        aegisd_unregister(c);
+    }
+}
+
+static void aegisd_unregister(const nfds_t c) {
+    struct aegisd_client *client = &g_aegisd.clients[c];
+    struct aegis_board_slot *slot;
+    nfds_t last = g_aegisd.fds_nr - 1;
+
+    if (client->slot != -1) {
+        slot = &g_aegisd.board->slots[client->slot];
+        aegis_board_slot_write(slot, 0, 0, slot->generation);
+        g_aegisd.slot_in_use[client->slot] = 0;
+    }
+
+    close(g_aegisd.fds[c].fd);
+
+    if (c != last) {
+        g_aegisd.fds[c] = g_aegisd.fds[last];
+        g_aegisd.clients[c] = g_aegisd.clients[last];
+    }
+
+    g_aegisd.fds_nr--;
+}
+
+static void aegisd_sweep(void) {
+    struct aegisd_client *client;
+    uint32_t verdict;
+    nfds_t c;
+
+    for (c = 1; c < g_aegisd.fds_nr; c++) {
+        client = &g_aegisd.clients[c];
+        if (client->slot == -1) {
+            continue;
+        }
+        verdict = (uint32_t)aegis_procfs_has_tracer(client->pid);
+        // INFO(Rafael): Only touching the slot on changes keeps readers' cache lines quiet.
+        if (verdict != client->verdict) {
+            client->verdict = verdict;
+            aegis_board_slot_write(&g_aegisd.board->slots[client->slot], client->pid, verdict,
+                                   g_aegisd.board->slots[client->slot].generation);
+        }
+    }
+
+    __atomic_store_n(&g_aegisd.board->heartbeat, aegis_board_now(), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <aegis.h>
+#include <native/linux/aegis_procfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define PROCFSBENCH_TRACER_PID 4242
+
+#define PROCFSBENCH_TASKS_PID 1
+
+#define PROCFSBENCH_FIXTURES_NR 64
+
+// INFO(Rafael): Comm is limited to 15 chars by the kernel but it is free text. Anything goes.
+static const char *g_procfsbench_comms[] = {
+    "bash",
+    "a) t (b",
+    ")",
+    ") t 1 2 3 (",
+    "(sd-pam)",
+    "x) R (y) t (z",
+    "TracerPid:\t666",
+    "kworker/0:1H"
+};
+
+#define PROCFSBENCH_COMMS_NR (sizeof(g_procfsbench_comms) / sizeof(g_procfsbench_comms[0]))
+
+static const char *get_option(int argc, char **argv, const char *option, const char *default_value);
+
+static int procfsbench_gen(const char *root, const unsigned long pids_nr, const unsigned long tasks_nr);
+
+static int procfsbench_run(const char *root, const unsigned long pids_nr, const unsigned long tasks_nr);
+
+static int procfsbench_parsers(const unsigned long rounds);
+
+static int procfsbench_mkdir(const char *path);
+
+static int procfsbench_write(const char *path, const char *data, const size_t data_size);
+
+static size_t procfsbench_stat(const pid_t pid, char *buf, const size_t buf_size);
+
+static size_t procfsbench_status(const pid_t pid, char *buf, const size_t buf_size);
+
+static size_t procfsbench_stack(const pid_t pid, char *buf, const size_t buf_size);
+
+static char procfsbench_expected_state(const pid_t pid);
+
+static int procfsbench_expected_has_tracer(const pid_t pid);
+
+static pid_t procfsbench_expected_tracer_pid(const pid_t pid);
+
+static pid_t procfsbench_expected_ppid(const pid_t pid);
+
+static unsigned long long procfsbench_expected_starttime(const pid_t pid);
+
+static uint64_t procfsbench_now(void);
+
+static void procfsbench_report(const char *what, const unsigned long calls, const uint64_t nsecs,
+                               const unsigned long long bytes);
+
+int main(int argc, char **argv) {
+    const char *gen_root = get_option(argc, argv, "--gen", NULL);
+    const char *root = get_option(argc, argv, "--root", NULL);
+    unsigned long pids_nr = strtoul(get_option(argc, argv, "--pids", "100000"), NULL, 10);
+    unsigned long tasks_nr = strtoul(get_option(argc, argv, "--tasks", "4096"), NULL, 10);
+    unsigned long rounds = strtoul(get_option(argc, argv, "--rounds", "100000"), NULL, 10);
+    int err = 0;
+
+    if (get_option(argc, argv, "--help", NULL) != NULL || pids_nr == 0) {
+        fprintf(stdout, "use: %s [--gen=<dir> | --root=<dir>] [--pids=<n>] [--tasks=<n>] [--rounds=<n>]\n", argv[0]);
+        return 1;
+    }
+
+    if (gen_root != NULL) {
+        return procfsbench_gen(gen_root, pids_nr, tasks_nr);
+    }
+
+    err = procfsbench_parsers(rounds);
+
+    if (root != NULL) {
+        err |= procfsbench_run(root, pids_nr, tasks_nr);
+    }
+
+    return err;
+}
+
+static const char *get_option(int argc, char **argv, const char *option, const char *default_value) {
+    size_t option_size = strlen(option);
+    int a;
+
+    for (a = 1; a < argc; a++) {
+        if (strncmp(argv[a], option, option_size) == 0) {
+            if (argv[a][option_size] == '=') {
+                return &argv[a][option_size + 1];
+            } else if (argv[a][option_size] == 0) {
+                return argv[a];
+            }
+        }
+    }
+
+    return default_value;
+}
+
+static int procfsbench_gen(const char *root, const unsigned long pids_nr, const unsigned long tasks_nr) {
+    char path[AEGIS_PROCFS_ROOT_SIZE + 64], buf[4096];
+    size_t buf_size;
+    unsigned long p, t;
+    pid_t pid;
+
+    if (strlen(root) >= AEGIS_PROCFS_ROOT_SIZE || procfsbench_mkdir(root) != 0) {
+        fprintf(stderr, "error: unable to create '%s'.\n", root);
+        return 1;
+    }
+
+    for (p = 1; p <= pids_nr; p++) {
+        pid = (pid_t)p;
+
+        snprintf(path, sizeof(path), "%s/%d", root, pid);
+        if (procfsbench_mkdir(path) != 0) {
+            goto procfsbench_gen_error;
+        }
+
+        buf_size = procfsbench_stat(pid, buf, sizeof(buf));
+        snprintf(path, sizeof(path), "%s/%d/stat", root, pid);
+        if (procfsbench_write(path, buf, buf_size) != 0) {
+            goto procfsbench_gen_error;
+        }
+
+        buf_size = procfsbench_status(pid, buf, sizeof(buf));
+        snprintf(path, sizeof(path), "%s/%d/status", root, pid);
+        if (procfsbench_write(path, buf, buf_size) != 0) {
+            goto procfsbench_gen_error;
+        }
+
+        buf_size = procfsbench_stack(pid, buf, sizeof(buf));
+        snprintf(path, sizeof(path), "%s/%d/stack", root, pid);
+        if (procfsbench_write(path, buf, buf_size) != 0) {
+            goto procfsbench_gen_error;
+        }
+    }
+
+    // INFO(Rafael): A fat multithreaded process. Tids follow the pids so they get the same verdicts.
+    snprintf(path, sizeof(path), "%s/%d/task", root, PROCFSBENCH_TASKS_PID);
+    if (tasks_nr > 0 && procfsbench_mkdir(path) != 0) {
+        goto procfsbench_gen_error;
+    }
+
+    for (t = 1; t <= tasks_nr; t++) {
+        pid = (pid_t)(pids_nr + t);
+        snprintf(path, sizeof(path), "%s/%d/task/%d", root, PROCFSBENCH_TASKS_PID, pid);
+        if (procfsbench_mkdir(path) != 0) {
+            goto procfsbench_gen_error;
+        }
+        buf_size = procfsbench_stat(pid, buf, sizeof(buf));
+        snprintf(path, sizeof(path), "%s/%d/task/%d/stat", root, PROCFSBENCH_TASKS_PID, pid);
+        if (procfsbench_write(path, buf, buf_size) != 0) {
+            goto procfsbench_gen_error;
+        }
+    }
+
+    fprintf(stdout, "info: %lu pids and %lu tasks were generated under '%s'.\n", pids_nr, tasks_nr, root);
+
+    return 0;
+
+procfsbench_gen_error:
+
+    fprintf(stderr, "error: unable to write '%s': %s.\n", path, strerror(errno));
+
+    return 1;
+}
+
+static int procfsbench_run(const char *root, const unsigned long pids_nr, const unsigned long tasks_nr) {
+    char path[AEGIS_PROCFS_ROOT_SIZE + 64], buf[1024];
+    unsigned long p, t = 0, mismatches_nr = 0;
+    uint64_t start, elapsed;
+    DIR *dir;
+    struct dirent *entry;
+    FILE *fp;
+    size_t buf_size;
+    pid_t pid;
+
+    if (aegis_set_procfs_root(root) != 0) {
+        fprintf(stderr, "error: '%s' is not a valid procfs root.\n", root);
+        return 1;
+    }
+
+    start = procfsbench_now();
+    for (p = 1; p <= pids_nr; p++) {
+        if (aegis_procfs_has_tracer((pid_t)p) != procfsbench_expected_has_tracer((pid_t)p)) {
+            fprintf(stderr, "error: wrong has_tracer verdict for pid %lu.\n", p);
+            mismatches_nr++;
+        }
+    }
+    elapsed = procfsbench_now() - start;
+    procfsbench_report("aegis_procfs_has_tracer()", pids_nr, elapsed, 0);
+
+    start = procfsbench_now();
+    for (p = 1; p <= pids_nr; p++) {
+        if (aegis_procfs_tracer_pid((pid_t)p) != procfsbench_expected_tracer_pid((pid_t)p)) {
+            fprintf(stderr, "error: wrong tracer pid for pid %lu.\n", p);
+            mismatches_nr++;
+        }
+    }
+    elapsed = procfsbench_now() - start;
+    procfsbench_report("aegis_procfs_tracer_pid()", pids_nr, elapsed, 0);
+
+    snprintf(path, sizeof(path), "%s/%d/task", root, PROCFSBENCH_TASKS_PID);
+    if (tasks_nr > 0 && (dir = opendir(path)) != NULL) {
+        start = procfsbench_now();
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            pid = (pid_t)strtol(entry->d_name, NULL, 10);
+            snprintf(path, sizeof(path), "%s/%d/task/%s/stat", root, PROCFSBENCH_TASKS_PID, entry->d_name);
+            if ((fp = fopen(path, "rb")) == NULL) {
+                continue;
+            }
+            buf_size = fread(buf, 1, sizeof(buf) - 1, fp);
+            buf[buf_size] = 0;
+            fclose(fp);
+            if (aegis_procfs_parse_stat_state(buf, buf_size) != procfsbench_expected_state(pid)) {
+                fprintf(stderr, "error: wrong state for task %d.\n", pid);
+                mismatches_nr++;
+            }
+            t++;
+        }
+        elapsed = procfsbench_now() - start;
+        closedir(dir);
+        procfsbench_report("task stat walk", t, elapsed, 0);
+    }
+
+    aegis_set_procfs_root(NULL);
+
+    if (mismatches_nr > 0) {
+        fprintf(stderr, "error: %lu mismatches.\n", mismatches_nr);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int procfsbench_parsers(const unsigned long rounds) {
+    static char stats[PROCFSBENCH_FIXTURES_NR][1024];
+    static char statuses[PROCFSBENCH_FIXTURES_NR][2048];
+    size_t stat_sizes[PROCFSBENCH_FIXTURES_NR], status_sizes[PROCFSBENCH_FIXTURES_NR];
+    unsigned long long stat_bytes = 0, status_bytes = 0;
+    unsigned long r, mismatches_nr = 0;
+    uint64_t start, elapsed;
+    volatile char state_sink = 0;
+    volatile pid_t tracer_sink = 0;
+    pid_t ppid;
+    unsigned long long starttime;
+    char comm[64];
+    size_t f;
+
+    for (f = 0; f < PROCFSBENCH_FIXTURES_NR; f++) {
+        stat_sizes[f] = procfsbench_stat((pid_t)(f + 1), stats[f], sizeof(stats[f]));
+        status_sizes[f] = procfsbench_status((pid_t)(f + 1), statuses[f], sizeof(statuses[f]));
+        if (aegis_procfs_parse_stat_state(stats[f], stat_sizes[f]) != procfsbench_expected_state((pid_t)(f + 1))) {
+            fprintf(stderr, "error: stat parser got fixture %zu wrong.\n", f);
+            mismatches_nr++;
+        }
+        if (aegis_procfs_parse_status_tracer_pid(statuses[f], status_sizes[f]) !=
+                                                            procfsbench_expected_tracer_pid((pid_t)(f + 1))) {
+            fprintf(stderr, "error: status parser got fixture %zu wrong.\n", f);
+            mismatches_nr++;
+        }
+        if (aegis_procfs_parse_stat_lineage(stats[f], stat_sizes[f], &ppid, &starttime, comm, sizeof(comm)) != 0 ||
+            ppid != procfsbench_expected_ppid((pid_t)(f + 1)) ||
+            starttime != procfsbench_expected_starttime((pid_t)(f + 1)) ||
+            strcmp(comm, g_procfsbench_comms[(f + 1) % PROCFSBENCH_COMMS_NR]) != 0) {
+            fprintf(stderr, "error: stat lineage parser got fixture %zu wrong.\n", f);
+            mismatches_nr++;
+        }
+    }
+
+    start = procfsbench_now();
+    for (r = 0; r < rounds; r++) {
+        f = r % PROCFSBENCH_FIXTURES_NR;
+        state_sink = aegis_procfs_parse_stat_state(stats[f], stat_sizes[f]);
+        stat_bytes += stat_sizes[f];
+    }
+    elapsed = procfsbench_now() - start;
+    procfsbench_report("aegis_procfs_parse_stat_state()", rounds, elapsed, stat_bytes);
+
+    start = procfsbench_now();
+    for (r = 0; r < rounds; r++) {
+        f = r % PROCFSBENCH_FIXTURES_NR;
+        tracer_sink = aegis_procfs_parse_status_tracer_pid(statuses[f], status_sizes[f]);
+        status_bytes += status_sizes[f];
+    }
+    elapsed = procfsbench_now() - start;
+    procfsbench_report("aegis_procfs_parse_status_tracer_pid()", rounds, elapsed, status_bytes);
+
+    start = procfsbench_now();
+    for (r = 0; r < rounds; r++) {
+        f = r % PROCFSBENCH_FIXTURES_NR;
+        aegis_procfs_parse_stat_lineage(stats[f], stat_sizes[f], &ppid, &starttime, comm, sizeof(comm));
+        tracer_sink = ppid;
+    }
+    elapsed = procfsbench_now() - start;
+    procfsbench_report("aegis_procfs_parse_stat_lineage()", rounds, elapsed, stat_bytes);
+
+    (void)state_sink;
+    (void)tracer_sink;
+
+    return (mismatches_nr > 0);
+}
+
+static int procfsbench_mkdir(const char *path) {
+    return (mkdir(path, 0755) != 0 && errno != EEXIST);
+}
+
+static int procfsbench_write(const char *path, const char *data, const size_t data_size) {
+    FILE *fp;
+    int err = 1;
+
+    if ((fp = fopen(path, "wb")) == NULL) {
+        return err;
+    }
+
+    err = (fwrite(data, 1, data_size, fp) != data_size);
+
+    fclose(fp);
+
+    return err;
+}
+
+// INFO(Rafael): Fixtures follow the layout of proc(5). Verdicts only depend on the pid, so whoever
+//               reads the tree back knows what to expect without any side file.
+
+static size_t procfsbench_stat(const pid_t pid, char *buf, const size_t buf_size) {
+    int size = snprintf(buf, buf_size, "%d (%s) %c %d %d %d 0 -1 4194560 %d 0 0 0 %d %d 0 0 20 0 1 0 %llu "
+                                       "23527424 1313 18446744073709551615 94245954211840 94245954950045 "
+                                       "140726434405104 0 0 0 65536 3670020 1266777851 0 0 0 17 0 0 0 0 0 0 "
+                                       "94245955186480 94245955234308 94245980876800 140726434412346 "
+                                       "140726434412352 140726434412352 140726434414574 0\n",
+                        pid, g_procfsbench_comms[pid % PROCFSBENCH_COMMS_NR], procfsbench_expected_state(pid),
+                        procfsbench_expected_ppid(pid), pid, pid, pid * 7, pid % 97, pid % 13,
+                        procfsbench_expected_starttime(pid));
+    return (size_t)size;
+}
+
+static size_t procfsbench_status(const pid_t pid, char *buf, const size_t buf_size) {
+    int size = snprintf(buf, buf_size, "Name:\t%s\n"
+                                       "Umask:\t0022\n"
+                                       "State:\t%c\n"
+                                       "Tgid:\t%d\n"
+                                       "Ngid:\t0\n"
+                                       "Pid:\t%d\n"
+                                       "PPid:\t%d\n"
+                                       "TracerPid:\t%d\n"
+                                       "Uid:\t1000\t1000\t1000\t1000\n"
+                                       "Gid:\t1000\t1000\t1000\t1000\n"
+                                       "FDSize:\t256\n"
+                                       "Groups:\t4 24 27 30 46 1000\n"
+                                       "VmPeak:\t   22980 kB\n"
+                                       "VmSize:\t   22976 kB\n"
+                                       "VmRSS:\t    5252 kB\n"
+                                       "Threads:\t1\n"
+                                       "SigQ:\t0/63448\n"
+                                       "SigBlk:\t0000000000010000\n"
+                                       "SigCgt:\t000000004b813efb\n"
+                                       "CapEff:\t0000000000000000\n"
+                                       "Seccomp:\t0\n"
+                                       "voluntary_ctxt_switches:\t%d\n"
+                                       "nonvoluntary_ctxt_switches:\t%d\n",
+                        g_procfsbench_comms[pid % PROCFSBENCH_COMMS_NR], procfsbench_expected_state(pid), pid, pid,
+                        procfsbench_expected_ppid(pid), procfsbench_expected_tracer_pid(pid), pid % 211, pid % 17);
+    return (size_t)size;
+}
+
+static size_t procfsbench_stack(const pid_t pid, char *buf, const size_t buf_size) {
+    int size;
+    if (pid % 11 == 0) {
+        size = snprintf(buf, buf_size, "[<0>] ptrace_stop+0x16c/0x290\n"
+                                       "[<0>] get_signal+0x6e1/0x8d0\n"
+                                       "[<0>] arch_do_signal_or_restart+0x3e/0x240\n"
+                                       "[<0>] exit_to_user_mode_prepare+0x149/0x1b0\n");
+    } else {
+        size = snprintf(buf, buf_size, "[<0>] do_select+0x5a2/0x800\n"
+                                       "[<0>] core_sys_select+0x1bd/0x3a0\n"
+                                       "[<0>] do_pselect.constprop.0+0xe9/0x180\n"
+                                       "[<0>] entry_SYSCALL_64_after_hwframe+0x44/0xae\n");
+    }
+    return (size_t)size;
+}
+
+static char procfsbench_expected_state(const pid_t pid) {
+    if (pid % 5 == 0) {
+        return 't';
+    }
+    return (pid % 2 == 0) ? 'R' : 'S';
+}
+
+static int procfsbench_expected_has_tracer(const pid_t pid) {
+    return (pid % 5 == 0 || pid % 11 == 0);
+}
+
+static pid_t procfsbench_expected_tracer_pid(const pid_t pid) {
+    return (pid % 3 == 0) ? PROCFSBENCH_TRACER_PID : 0;
+}
+
+static pid_t procfsbench_expected_ppid(const pid_t pid) {
+    return (pid > 1) ? pid - 1 : 0;
+}
+
+static unsigned long long procfsbench_expected_starttime(const pid_t pid) {
+    return (unsigned long long)pid * 3;
+}
+
+static uint64_t procfsbench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static void procfsbench_report(const char *what, const unsigned long calls, const uint64_t nsecs,
+                               const unsigned long long bytes) {
+    double secs = (double)nsecs / 1e9;
+    fprintf(stdout, "%-40s %10lu calls %10.1f ns/call", what, calls, (calls > 0) ? (double)nsecs / calls : 0.0);
+    if (bytes > 0 && secs > 0) {
+        fprintf(stdout, " %10.1f MiB/s", ((double)bytes / (1024.0 * 1024.0)) / secs);
+    }
+    fprintf(stdout, "\n");
+}
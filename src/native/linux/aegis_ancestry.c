@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <aegis.h>
+#include <native/linux/aegis_ancestry.h>
+#include <native/linux/aegis_procfs.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define AEGIS_ANCESTRY_CACHE_SIZE 64
+
+#define AEGIS_ANCESTRY_MAX_DEPTH 64
+
+#define AEGIS_ANCESTRY_NAME_SIZE 256
+
+struct aegis_ancestry_entry {
+    pid_t pid;
+    unsigned long long starttime;
+    int verdict;
+};
+
+struct aegis_ancestry_ctx {
+    // INFO(Rafael): A pid alone can be recycled, (pid, starttime) names a process for good. Each entry holds
+    //               the verdict for the whole chain from that process up to init.
+    struct aegis_ancestry_entry cache[AEGIS_ANCESTRY_CACHE_SIZE];
+    uint64_t last;
+    pthread_mutex_t mtx;
+};
+
+static struct aegis_ancestry_ctx g_aegis_ancestry = { { { 0 } }, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t g_aegis_ancestry_atfork_once = PTHREAD_ONCE_INIT;
+
+// INFO(Rafael): Launchers that keep tracing what they launch. Versioned names ("gdb-multiarch",
+//               "lldb-15") are also matched.
+static const char *g_aegis_ancestry_tracers[] = {
+    "gdb",
+    "gdbserver",
+    "lldb",
+    "strace",
+    "ltrace",
+    "rr",
+    "radare2",
+    "r2",
+    "edb",
+    "frida"
+};
+
+#define AEGIS_ANCESTRY_TRACERS_NR (sizeof(g_aegis_ancestry_tracers) / sizeof(g_aegis_ancestry_tracers[0]))
+
+// INFO(Rafael): The last verdict is packed as [ generation:30 | ppid:32 | is_valid:1 | verdict:1 ], so
+//               validating it takes one atomic load and one getppid().
+#define aegis_ancestry_pack(generation, ppid, verdict) ( ((uint64_t)((generation) & 0x3FFFFFFF) << 34) |\
+                                                         ((uint64_t)(uint32_t)(ppid) << 2) | 0x2 |\
+                                                         ((uint64_t)((verdict) != 0)) )
+
+static void aegis_ancestry_atfork_prepare(void);
+
+static void aegis_ancestry_atfork_parent(void);
+
+static void aegis_ancestry_atfork_child(void);
+
+static void aegis_ancestry_register_atfork(void);
+
+static int aegis_ancestry_walk(const pid_t ppid, const unsigned int generation);
+
+static int aegis_ancestry_is_tracer(const pid_t pid, const char *comm);
+
+static struct aegis_ancestry_entry *aegis_ancestry_lookup(const pid_t pid, const unsigned long long starttime);
+
+int aegis_ancestry_has_tracer(void) {
+    pid_t ppid = getppid();
+    unsigned int generation = aegis_procfs_root_generation();
+    uint64_t last = __atomic_load_n(&g_aegis_ancestry.last, __ATOMIC_ACQUIRE);
+    int has;
+
+    // INFO(Rafael): While a process is our parent its pid cannot be recycled. The same ppid means the same
+    //               parent, a different one means we were reparented (or forked) and the chain is walked again.
+    if ((last & ~(uint64_t)0x1) == (aegis_ancestry_pack(generation, ppid, 0) & ~(uint64_t)0x1)) {
+        return (int)(last & 0x1);
+    }
+
+    pthread_once(&g_aegis_ancestry_atfork_once, aegis_ancestry_register_atfork);
+
+    pthread_mutex_lock(&g_aegis_ancestry.mtx);
+    has = aegis_ancestry_walk(ppid, generation);
+    __atomic_store_n(&g_aegis_ancestry.last, aegis_ancestry_pack(generation, ppid, has), __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_aegis_ancestry.mtx);
+
+    return has;
+}
+
+static int aegis_ancestry_walk(const pid_t ppid, const unsigned int generation) {
+    static unsigned int cache_generation = 0;
+    struct aegis_ancestry_entry chain[AEGIS_ANCESTRY_MAX_DEPTH], *entry;
+    char comm[AEGIS_ANCESTRY_NAME_SIZE];
+    pid_t pid = ppid, next_pid;
+    unsigned long long starttime;
+    size_t chain_nr = 0, c;
+    int verdict = 0;
+
+    if (cache_generation != generation) {
+        memset(g_aegis_ancestry.cache, 0, sizeof(g_aegis_ancestry.cache));
+        cache_generation = generation;
+    }
+
+    while (pid > 0 && chain_nr < AEGIS_ANCESTRY_MAX_DEPTH) {
+        if (aegis_procfs_stat_lineage(pid, &next_pid, &starttime, comm, sizeof(comm)) != 0) {
+            break;
+        }
+
+        if ((entry = aegis_ancestry_lookup(pid, starttime)) != NULL) {
+            verdict = entry->verdict;
+            break;
+        }
+
+        chain[chain_nr].pid = pid;
+        chain[chain_nr].starttime = starttime;
+        chain[chain_nr].verdict = aegis_ancestry_is_tracer(pid, comm);
+        chain_nr++;
+
+        pid = (next_pid != pid) ? next_pid : 0;
+    }
+
+    for (c = chain_nr; c-- > 0;) {
+        verdict |= chain[c].verdict;
+        chain[c].verdict = verdict;
+        g_aegis_ancestry.cache[chain[c].pid % AEGIS_ANCESTRY_CACHE_SIZE] = chain[c];
+    }
+
+    return verdict;
+}
+
+static int aegis_ancestry_is_tracer(const pid_t pid, const char *comm) {
+    char exe_name[AEGIS_ANCESTRY_NAME_SIZE];
+    const char *name = (aegis_procfs_exe_name(pid, exe_name, sizeof(exe_name)) == 0) ? exe_name : comm;
+    size_t t, tracer_size;
+
+    for (t = 0; t < AEGIS_ANCESTRY_TRACERS_NR; t++) {
+        tracer_size = strlen(g_aegis_ancestry_tracers[t]);
+        if (strncmp(name, g_aegis_ancestry_tracers[t], tracer_size) == 0 &&
+            (name[tracer_size] == 0 || name[tracer_size] == '-')) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static struct aegis_ancestry_entry *aegis_ancestry_lookup(const pid_t pid, const unsigned long long starttime) {
+    struct aegis_ancestry_entry *entry = &g_aegis_ancestry.cache[pid % AEGIS_ANCESTRY_CACHE_SIZE];
+    return (entry->pid == pid && entry->starttime == starttime) ? entry : NULL;
+}
+
+static void aegis_ancestry_atfork_prepare(void) {
+    pthread_mutex_lock(&g_aegis_ancestry.mtx);
+}
+
+static void aegis_ancestry_atfork_parent(void) {
+    pthread_mutex_unlock(&g_aegis_ancestry.mtx);
+}
+
+static void aegis_ancestry_atfork_child(void) {
+    // INFO(Rafael): Our ancestors are still the child's ones, only the fast path verdict is not its own.
+    __atomic_store_n(&g_aegis_ancestry.last, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_aegis_ancestry.mtx);
+}
+
+static void aegis_ancestry_register_atfork(void) {
+    pthread_atfork(aegis_ancestry_atfork_prepare, aegis_ancestry_atfork_parent, aegis_ancestry_atfork_child);
+}
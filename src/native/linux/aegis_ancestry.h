@@ -0,0 +1,13 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#ifndef AEGIS_NATIVE_LINUX_AEGIS_ANCESTRY_H
+#define AEGIS_NATIVE_LINUX_AEGIS_ANCESTRY_H 1
+
+int aegis_ancestry_has_tracer(void);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#ifndef AEGIS_NATIVE_LINUX_AEGIS_BOARD_H
+#define AEGIS_NATIVE_LINUX_AEGIS_BOARD_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+// INFO(Rafael): Layout of the status board shared between aegisd (the only writer) and
+//               its registered processes (readers, mapping it read-only).
+
+#define AEGIS_BOARD_MAGIC 0x41454753
+
+#define AEGIS_BOARD_VERSION 1
+
+#define AEGIS_BOARD_DEFAULT_NAME "/aegisd-board"
+
+#define AEGIS_BOARD_NAME_SIZE 64
+
+#define AEGIS_BOARD_SLOTS_NR 4096
+
+#define AEGIS_BOARD_MIN_STALE_NSECS 100000000ULL
+
+struct aegis_board_slot {
+    uint32_t seq;
+    int32_t pid;
+    uint32_t verdict;
+    uint32_t generation;
+    uint8_t pad[48];
+} __attribute__((aligned(64)));
+
+struct aegis_board {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots_nr;
+    int32_t daemon_pid;
+    uint64_t heartbeat;
+    uint64_t stale_nsecs;
+    uint8_t pad[32];
+    struct aegis_board_slot slots[AEGIS_BOARD_SLOTS_NR];
+};
+
+struct aegis_board_hello {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct aegis_board_reply {
+    uint32_t magic;
+    int32_t status;
+    uint32_t slot;
+    uint32_t generation;
+    char board_name[AEGIS_BOARD_NAME_SIZE];
+};
+
+static inline uint64_t aegis_board_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static inline void aegis_board_slot_write(struct aegis_board_slot *slot, const int32_t pid,
+                                          const uint32_t verdict, const uint32_t generation) {
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->pid, pid, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->verdict, verdict, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->generation, generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline void aegis_board_slot_read(const struct aegis_board_slot *slot, int32_t *pid,
+                                         uint32_t *verdict, uint32_t *generation) {
+    uint32_t seq_begin, seq_end;
+    do {
+        seq_begin = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        *pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+        *verdict = __atomic_load_n(&slot->verdict, __ATOMIC_RELAXED);
+        *generation = __atomic_load_n(&slot->generation, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq_end = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    } while ((seq_begin & 1) || seq_begin != seq_end);
+}
+
+#endif
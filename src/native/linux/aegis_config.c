@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <aegis.h>
+#include <native/linux/aegis_config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define AEGIS_CONFIG_LINE_SIZE 256
+
+#define AEGIS_CONFIG_SETTLE_NSECS 10000000
+
+#define AEGIS_CONFIG_SETTLE_TRIES_NR 10
+
+struct aegis_config_ctx {
+    // INFO(Rafael): Readers hold snapshots for as long as they want, so published ones are never released.
+    //               Only actual changes are published, it costs a few bytes per human edit.
+    const struct aegis_config *current;
+    char filepath[PATH_MAX];
+    char dirpath[PATH_MAX];
+    const char *filename;
+    int inotify_fd;
+    int needs_rearm;
+    pthread_mutex_t mtx;
+};
+
+static const struct aegis_config g_aegis_config_defaults = { 0, 0, AEGIS_CONFIG_HEURISTICS_UNSET,
+                                                             AEGIS_CONFIG_ON_DEBUGGER_CALLBACK };
+
+static struct aegis_config_ctx g_aegis_config = { &g_aegis_config_defaults, "", "", NULL, -1, 0,
+                                                  PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t g_aegis_config_once = PTHREAD_ONCE_INIT;
+
+static void aegis_config_atfork_prepare(void);
+
+static void aegis_config_atfork_parent(void);
+
+static void aegis_config_atfork_child(void);
+
+static void aegis_config_init(void);
+
+static void aegis_config_reload(void);
+
+static int aegis_config_watch(void);
+
+static void aegis_config_rearm(void);
+
+static void *aegis_config_watcher_routine(void *args);
+
+static char *aegis_config_trim(char *str);
+
+static int aegis_config_parse_usecs(const char *value, unsigned int *usecs);
+
+static int aegis_config_parse_heuristics(char *value, unsigned int *heuristics);
+
+static int aegis_config_parse_settled(struct aegis_config *config);
+
+const struct aegis_config *aegis_config_get(void) {
+    pthread_once(&g_aegis_config_once, aegis_config_init);
+    if (__atomic_load_n(&g_aegis_config.needs_rearm, __ATOMIC_RELAXED)) {
+        aegis_config_rearm();
+    }
+    return __atomic_load_n(&g_aegis_config.current, __ATOMIC_ACQUIRE);
+}
+
+int aegis_config_parse(const char *filepath, struct aegis_config *config) {
+    FILE *fp;
+    char line[AEGIS_CONFIG_LINE_SIZE], *key, *value, *eq;
+    struct aegis_config parsed = g_aegis_config_defaults;
+    int err = 1;
+
+    if ((fp = fopen(filepath, "re")) == NULL) {
+        return err;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strchr(line, '\n') == NULL && !feof(fp)) {
+            goto aegis_config_parse_epilogue;
+        }
+
+        key = aegis_config_trim(line);
+        if (*key == 0 || *key == '#') {
+            continue;
+        }
+
+        if ((eq = strchr(key, '=')) == NULL) {
+            goto aegis_config_parse_epilogue;
+        }
+
+        *eq = 0;
+        key = aegis_config_trim(key);
+        value = aegis_config_trim(eq + 1);
+
+        if (strcmp(key, "gorgon_active_usecs") == 0) {
+            if (aegis_config_parse_usecs(value, &parsed.gorgon_active_usecs) != 0) {
+                goto aegis_config_parse_epilogue;
+            }
+        } else if (strcmp(key, "gorgon_idle_usecs") == 0) {
+            if (strcmp(value, "sleep") == 0) {
+                parsed.gorgon_idle_usecs = AEGIS_GORGON_SLEEP_WHEN_IDLE;
+            } else if (aegis_config_parse_usecs(value, &parsed.gorgon_idle_usecs) != 0) {
+                goto aegis_config_parse_epilogue;
+            }
+        } else if (strcmp(key, "heuristics") == 0) {
+            if (aegis_config_parse_heuristics(value, &parsed.heuristics) != 0) {
+                goto aegis_config_parse_epilogue;
+            }
+        } else if (strcmp(key, "on_debugger") == 0) {
+            if (strcmp(value, "callback") == 0) {
+                parsed.on_debugger = AEGIS_CONFIG_ON_DEBUGGER_CALLBACK;
+            } else if (strcmp(value, "exit") == 0) {
+                parsed.on_debugger = AEGIS_CONFIG_ON_DEBUGGER_EXIT;
+            } else if (strcmp(value, "abort") == 0) {
+                parsed.on_debugger = AEGIS_CONFIG_ON_DEBUGGER_ABORT;
+            } else if (strcmp(value, "ignore") == 0) {
+                parsed.on_debugger = AEGIS_CONFIG_ON_DEBUGGER_IGNORE;
+            } else {
+                goto aegis_config_parse_epilogue;
+            }
+        } else {
+            goto aegis_config_parse_epilogue;
+        }
+    }
+
+    *config = parsed;
+    err = 0;
+
+aegis_config_parse_epilogue:
+
+    fclose(fp);
+
+    return err;
+}
+
+static void aegis_config_init(void) {
+    const char *filepath = getenv(AEGIS_CONFIG_ENV);
+    char *slash;
+
+    if (filepath == NULL || *filepath == 0 || strlen(filepath) >= sizeof(g_aegis_config.filepath)) {
+        return;
+    }
+
+    strncpy(g_aegis_config.filepath, filepath, sizeof(g_aegis_config.filepath) - 1);
+    strncpy(g_aegis_config.dirpath, filepath, sizeof(g_aegis_config.dirpath) - 1);
+
+    if ((slash = strrchr(g_aegis_config.dirpath, '/')) == NULL) {
+        strncpy(g_aegis_config.dirpath, ".", sizeof(g_aegis_config.dirpath) - 1);
+        g_aegis_config.filename = g_aegis_config.filepath;
+    } else {
+        g_aegis_config.filename = g_aegis_config.filepath + (slash - g_aegis_config.dirpath) + 1;
+        *(slash + (slash == g_aegis_config.dirpath)) = 0;
+    }
+
+    aegis_config_reload();
+
+    if (aegis_config_watch() == 0) {
+        pthread_atfork(aegis_config_atfork_prepare, aegis_config_atfork_parent, aegis_config_atfork_child);
+    }
+}
+
+static int aegis_config_watch(void) {
+    pthread_t watcher;
+
+    if ((g_aegis_config.inotify_fd = inotify_init1(IN_CLOEXEC)) == -1) {
+        return 1;
+    }
+
+    if (inotify_add_watch(g_aegis_config.inotify_fd, g_aegis_config.dirpath, IN_CLOSE_WRITE | IN_MOVED_TO) == -1 ||
+        pthread_create(&watcher, NULL, aegis_config_watcher_routine, NULL) != 0) {
+        close(g_aegis_config.inotify_fd);
+        g_aegis_config.inotify_fd = -1;
+        return 1;
+    }
+
+    pthread_detach(watcher);
+
+    return 0;
+}
+
+static void aegis_config_rearm(void) {
+    if (!__atomic_exchange_n(&g_aegis_config.needs_rearm, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    aegis_config_reload();
+    aegis_config_watch();
+}
+
+static void aegis_config_atfork_prepare(void) {
+    pthread_mutex_lock(&g_aegis_config.mtx);
+}
+
+static void aegis_config_atfork_parent(void) {
+    pthread_mutex_unlock(&g_aegis_config.mtx);
+}
+
+static void aegis_config_atfork_child(void) {
+    pthread_mutex_unlock(&g_aegis_config.mtx);
+
+    // INFO(Rafael): An inherited inotify descriptor shares its events with our parent and siblings. The child
+    //               gets its own one (and its own watcher) on its first probe.
+    if (g_aegis_config.inotify_fd != -1) {
+        close(g_aegis_config.inotify_fd);
+        g_aegis_config.inotify_fd = -1;
+    }
+    g_aegis_config.needs_rearm = 1;
+}
+
+static void aegis_config_reload(void) {
+    struct aegis_config parsed, *snapshot;
+
+    if (aegis_config_parse_settled(&parsed) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_aegis_config.mtx);
+    if (memcmp(g_aegis_config.current, &parsed, sizeof(parsed)) != 0 &&
+        (snapshot = (struct aegis_config *)malloc(sizeof(struct aegis_config))) != NULL) {
+        *snapshot = parsed;
+        __atomic_store_n(&g_aegis_config.current, snapshot, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_aegis_config.mtx);
+}
+
+static void *aegis_config_watcher_routine(void *args) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t buf_size;
+    char *bp;
+    int should_reload;
+
+    for (;;) {
+        if ((buf_size = read(g_aegis_config.inotify_fd, buf, sizeof(buf))) <= 0) {
+            if (buf_size == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        should_reload = 0;
+        for (bp = buf; bp < buf + buf_size; bp += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)bp;
+            should_reload |= (event->len > 0 && strcmp(event->name, g_aegis_config.filename) == 0);
+        }
+
+        if (should_reload) {
+            aegis_config_reload();
+        }
+    }
+
+    return NULL;
+}
+
+static int aegis_config_parse_settled(struct aegis_config *config) {
+    struct timespec settle = { 0, AEGIS_CONFIG_SETTLE_NSECS };
+    struct stat before, after;
+    size_t t;
+
+    // INFO(Rafael): A file rewritten in place is empty or half written for a while. An empty one is never
+    //               taken, otherwise it is parsed again until it stops changing under us.
+    for (t = 0; t < AEGIS_CONFIG_SETTLE_TRIES_NR; t++) {
+        if (stat(g_aegis_config.filepath, &before) != 0 || before.st_size == 0 ||
+            aegis_config_parse(g_aegis_config.filepath, config) != 0) {
+            return 1;
+        }
+        nanosleep(&settle, NULL);
+        if (stat(g_aegis_config.filepath, &after) == 0 && after.st_ino == before.st_ino &&
+            after.st_size == before.st_size && after.st_mtim.tv_sec == before.st_mtim.tv_sec &&
+            after.st_mtim.tv_nsec == before.st_mtim.tv_nsec) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static char *aegis_config_trim(char *str) {
+    char *end;
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char)*(end - 1))) {
+        end--;
+    }
+    *end = 0;
+    return str;
+}
+
+static int aegis_config_parse_usecs(const char *value, unsigned int *usecs) {
+    char *end;
+    unsigned long parsed;
+
+    if (!isdigit((unsigned char)*value)) {
+        return 1;
+    }
+
+    errno = 0;
+    parsed = strtoul(value, &end, 10);
+
+    if (errno != 0 || *end != 0 || parsed == 0 || parsed >= AEGIS_GORGON_SLEEP_WHEN_IDLE) {
+        return 1;
+    }
+
+    *usecs = (unsigned int)parsed;
+
+    return 0;
+}
+
+static int aegis_config_parse_heuristics(char *value, unsigned int *heuristics) {
+    char *name, *next;
+    unsigned int parsed = 0;
+
+    if (strcmp(value, "none") == 0) {
+        *heuristics = 0;
+        return 0;
+    }
+
+    for (name = value; name != NULL; name = next) {
+        if ((next = strchr(name, ',')) != NULL) {
+            *next = 0;
+            next++;
+        }
+        name = aegis_config_trim(name);
+        if (strcmp(name, "procfs") == 0) {
+            parsed |= AEGIS_HEURISTIC_PROCFS;
+        } else if (strcmp(name, "selftrap") == 0) {
+            parsed |= AEGIS_HEURISTIC_SELFTRAP;
+        } else if (strcmp(name, "ancestry") == 0) {
+            parsed |= AEGIS_HEURISTIC_ANCESTRY;
+        } else {
+            return 1;
+        }
+    }
+
+    *heuristics = parsed;
+
+    return 0;
+}
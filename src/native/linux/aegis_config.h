@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#ifndef AEGIS_NATIVE_LINUX_AEGIS_CONFIG_H
+#define AEGIS_NATIVE_LINUX_AEGIS_CONFIG_H 1
+
+#define AEGIS_CONFIG_ON_DEBUGGER_CALLBACK 0
+#define AEGIS_CONFIG_ON_DEBUGGER_EXIT     1
+#define AEGIS_CONFIG_ON_DEBUGGER_ABORT    2
+#define AEGIS_CONFIG_ON_DEBUGGER_IGNORE   3
+
+#define AEGIS_CONFIG_HEURISTICS_UNSET ((unsigned int)-1)
+
+struct aegis_config {
+    // INFO(Rafael): Zeroed probe intervals and AEGIS_CONFIG_HEURISTICS_UNSET mean "not configured",
+    //               what was passed by code is used.
+    unsigned int gorgon_active_usecs;
+    unsigned int gorgon_idle_usecs;
+    unsigned int heuristics;
+    int on_debugger;
+};
+
+const struct aegis_config *aegis_config_get(void);
+
+int aegis_config_parse(const char *filepath, struct aegis_config *config);
+
+#endif
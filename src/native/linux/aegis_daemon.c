@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <aegis.h>
+#include <native/linux/aegis_daemon.h>
+#include <native/linux/aegis_board.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define AEGIS_DAEMON_RETRY_NSECS 1000000000ULL
+
+struct aegis_daemon_ctx {
+    int sockfd;
+    struct aegis_board *board;
+    struct aegis_board_slot *slot;
+    pid_t pid;
+    uint32_t generation;
+    char socket_path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+    int should_reattach;
+    uint64_t retry_at;
+    unsigned int readers_nr;
+    pthread_mutex_t mtx;
+};
+
+static struct aegis_daemon_ctx g_aegis_daemon = { -1, NULL, NULL, 0, 0, "", 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t g_aegis_daemon_atfork_once = PTHREAD_ONCE_INIT;
+
+static int aegis_daemon_attach_unlocked(const char *socket_path);
+
+static int aegis_daemon_retry_attach(void);
+
+static void aegis_daemon_detach_unlocked(void);
+
+static int aegis_daemon_read_verdict(int *has);
+
+static void aegis_daemon_atfork_prepare(void);
+
+static void aegis_daemon_atfork_parent(void);
+
+static void aegis_daemon_atfork_child(void);
+
+static void aegis_daemon_register_atfork(void);
+
+int aegis_daemon_attach(const char *socket_path) {
+    int err;
+    pthread_once(&g_aegis_daemon_atfork_once, aegis_daemon_register_atfork);
+    pthread_mutex_lock(&g_aegis_daemon.mtx);
+    err = aegis_daemon_attach_unlocked(socket_path);
+    pthread_mutex_unlock(&g_aegis_daemon.mtx);
+    return err;
+}
+
+void aegis_daemon_detach(void) {
+    pthread_mutex_lock(&g_aegis_daemon.mtx);
+    aegis_daemon_detach_unlocked();
+    g_aegis_daemon.socket_path[0] = 0;
+    pthread_mutex_unlock(&g_aegis_daemon.mtx);
+}
+
+int aegis_daemon_has_debugger(int *has) {
+    uint64_t retry_at;
+    int err;
+
+    if (__atomic_load_n(&g_aegis_daemon.should_reattach, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&g_aegis_daemon.should_reattach, 0, __ATOMIC_ACQ_REL)) {
+        aegis_daemon_attach(g_aegis_daemon.socket_path);
+    }
+
+    retry_at = __atomic_load_n(&g_aegis_daemon.retry_at, __ATOMIC_RELAXED);
+    if (retry_at != 0 && aegis_board_now() >= retry_at &&
+        __atomic_compare_exchange_n(&g_aegis_daemon.retry_at, &retry_at, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) &&
+        aegis_daemon_retry_attach() != 0) {
+        __atomic_store_n(&g_aegis_daemon.retry_at, aegis_board_now() + AEGIS_DAEMON_RETRY_NSECS, __ATOMIC_RELAXED);
+    }
+
+    // INFO(Rafael): Pairs with the slot reset in aegis_daemon_detach_unlocked(). Both sides are seq_cst, so
+    //               either we see no slot or the detaching thread sees us and waits before unmapping.
+    __atomic_fetch_add(&g_aegis_daemon.readers_nr, 1, __ATOMIC_SEQ_CST);
+    err = aegis_daemon_read_verdict(has);
+    __atomic_fetch_sub(&g_aegis_daemon.readers_nr, 1, __ATOMIC_RELEASE);
+
+    return err;
+}
+
+static int aegis_daemon_attach_unlocked(const char *socket_path) {
+    struct sockaddr_un addr;
+    struct aegis_board_hello hello = { AEGIS_BOARD_MAGIC, AEGIS_BOARD_VERSION };
+    struct aegis_board_reply reply;
+    struct timeval timeout = { 1, 0 };
+    struct aegis_board *board = MAP_FAILED;
+    int sockfd = -1, shmfd = -1;
+    int err = 1;
+
+    aegis_daemon_detach_unlocked();
+
+    if (socket_path == NULL) {
+        socket_path = AEGIS_DAEMON_DEFAULT_SOCKET;
+    }
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        goto aegis_daemon_attach_epilogue;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    if ((sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+        goto aegis_daemon_attach_epilogue;
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        send(sockfd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) ||
+        recv(sockfd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        goto aegis_daemon_attach_epilogue;
+    }
+
+    if (reply.magic != AEGIS_BOARD_MAGIC || reply.status != 0 || reply.slot >= AEGIS_BOARD_SLOTS_NR) {
+        goto aegis_daemon_attach_epilogue;
+    }
+
+    reply.board_name[sizeof(reply.board_name) - 1] = 0;
+
+    if ((shmfd = shm_open(reply.board_name, O_RDONLY, 0)) == -1) {
+        goto aegis_daemon_attach_epilogue;
+    }
+
+    board = mmap(NULL, sizeof(struct aegis_board), PROT_READ, MAP_SHARED, shmfd, 0);
+    if (board == MAP_FAILED || board->magic != AEGIS_BOARD_MAGIC || board->version != AEGIS_BOARD_VERSION) {
+        goto aegis_daemon_attach_epilogue;
+    }
+
+    if (socket_path != g_aegis_daemon.socket_path) {
+        memset(g_aegis_daemon.socket_path, 0, sizeof(g_aegis_daemon.socket_path));
+        strncpy(g_aegis_daemon.socket_path, socket_path, sizeof(g_aegis_daemon.socket_path) - 1);
+    }
+
+    g_aegis_daemon.sockfd = sockfd;
+    __atomic_store_n(&g_aegis_daemon.board, board, __ATOMIC_RELAXED);
+    g_aegis_daemon.pid = getpid();
+    g_aegis_daemon.generation = reply.generation;
+    __atomic_store_n(&g_aegis_daemon.slot, &board->slots[reply.slot], __ATOMIC_RELEASE);
+
+    sockfd = -1;
+    board = MAP_FAILED;
+    err = 0;
+
+aegis_daemon_attach_epilogue:
+
+    if (board != MAP_FAILED) {
+        munmap(board, sizeof(struct aegis_board));
+    }
+
+    if (shmfd != -1) {
+        close(shmfd);
+    }
+
+    if (sockfd != -1) {
+        close(sockfd);
+    }
+
+    return err;
+}
+
+static int aegis_daemon_retry_attach(void) {
+    int err = 0;
+    pthread_mutex_lock(&g_aegis_daemon.mtx);
+    // INFO(Rafael): An empty path means that we were explicitly detached meanwhile.
+    if (g_aegis_daemon.socket_path[0] != 0) {
+        err = aegis_daemon_attach_unlocked(g_aegis_daemon.socket_path);
+    }
+    pthread_mutex_unlock(&g_aegis_daemon.mtx);
+    return err;
+}
+
+static void aegis_daemon_detach_unlocked(void) {
+    struct aegis_board *board = __atomic_load_n(&g_aegis_daemon.board, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_aegis_daemon.should_reattach, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_aegis_daemon.retry_at, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_aegis_daemon.slot, NULL, __ATOMIC_SEQ_CST);
+    if (board != NULL) {
+        while (__atomic_load_n(&g_aegis_daemon.readers_nr, __ATOMIC_SEQ_CST) > 0) {
+            sched_yield();
+        }
+        __atomic_store_n(&g_aegis_daemon.board, NULL, __ATOMIC_RELAXED);
+        munmap(board, sizeof(struct aegis_board));
+    }
+    if (g_aegis_daemon.sockfd != -1) {
+        close(g_aegis_daemon.sockfd);
+        g_aegis_daemon.sockfd = -1;
+    }
+}
+
+static int aegis_daemon_read_verdict(int *has) {
+    struct aegis_board_slot *slot = __atomic_load_n(&g_aegis_daemon.slot, __ATOMIC_SEQ_CST);
+    const struct aegis_board *board;
+    int32_t pid;
+    uint32_t verdict, generation;
+    uint64_t heartbeat;
+
+    if (slot == NULL) {
+        return 1;
+    }
+
+    board = __atomic_load_n(&g_aegis_daemon.board, __ATOMIC_RELAXED);
+
+    aegis_board_slot_read(slot, &pid, &verdict, &generation);
+
+    // INFO(Rafael): Heartbeat must be loaded before taking 'now', otherwise a fresh heartbeat
+    //               could be ahead of us and the unsigned difference would wrap around.
+    heartbeat = __atomic_load_n(&board->heartbeat, __ATOMIC_ACQUIRE);
+
+    if (pid != g_aegis_daemon.pid || generation != g_aegis_daemon.generation ||
+        (aegis_board_now() - heartbeat) > board->stale_nsecs) {
+        // INFO(Rafael): The board is only unmapped by the next attach (or detach), once the probes still
+        //               reading it are gone.
+        if (__atomic_compare_exchange_n(&g_aegis_daemon.slot, &slot, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&g_aegis_daemon.retry_at, aegis_board_now() + AEGIS_DAEMON_RETRY_NSECS,
+                             __ATOMIC_RELAXED);
+        }
+        return 1;
+    }
+
+    *has = (verdict != 0);
+
+    return 0;
+}
+
+static void aegis_daemon_atfork_prepare(void) {
+    pthread_mutex_lock(&g_aegis_daemon.mtx);
+}
+
+static void aegis_daemon_atfork_parent(void) {
+    pthread_mutex_unlock(&g_aegis_daemon.mtx);
+}
+
+static void aegis_daemon_atfork_child(void) {
+    // INFO(Rafael): The slot belongs to our parent, the child gets its own one on its first probe. Probes
+    //               reading the board were running on threads of our parent.
+    int was_attached = (g_aegis_daemon.slot != NULL);
+    g_aegis_daemon.readers_nr = 0;
+    pthread_mutex_unlock(&g_aegis_daemon.mtx);
+    __atomic_store_n(&g_aegis_daemon.slot, NULL, __ATOMIC_RELEASE);
+    if (g_aegis_daemon.sockfd != -1) {
+        close(g_aegis_daemon.sockfd);
+        g_aegis_daemon.sockfd = -1;
+    }
+    g_aegis_daemon.generation = 0;
+    g_aegis_daemon.retry_at = 0;
+    g_aegis_daemon.should_reattach = was_attached;
+}
+
+static void aegis_daemon_register_atfork(void) {
+    pthread_atfork(aegis_daemon_atfork_prepare, aegis_daemon_atfork_parent, aegis_daemon_atfork_child);
+}
@@ -6,49 +6,241 @@
  * LICENSE file in the root directory of this source tree.
  */
 #include <aegis.h>
+#include <native/linux/aegis_procfs.h>
+#include <native/linux/aegis_daemon.h>
+#include <native/linux/aegis_config.h>
+#include <native/linux/aegis_selftrap.h>
+#include <native/linux/aegis_ancestry.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
 #include <stdio.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#define AEGIS_WAIT_PROBE_INTERVAL_MSECS 10
+
+#define AEGIS_WAIT_SAFETY_PROBE_INTERVAL_MSECS 1000
+
+static unsigned int g_aegis_heuristics = AEGIS_HEURISTIC_PROCFS;
+
+static unsigned int aegis_heuristics(void);
+
+static int aegis_proc_connector_open(void);
+
+static int aegis_proc_connector_has_ptrace(const int fd, const pid_t pid);
+
+static int aegis_wait_probe(const pid_t pid);
 
 int aegis_has_debugger(void) {
-    int has = 0;
-    int fd = -1;
-    char proc_filepath[1024], proc_buf[1024];
-    char *bp = NULL, *bp_end = NULL;
-    ssize_t proc_buf_size = 0;
-    pid_t pid = getpid();
+    int has = 0, status = 0;
+    unsigned int heuristics;
+    pid_t pid, cpid;
+
+#if !defined(CGO)
+    aegis_rearm();
+#endif
+
+    // INFO(Rafael): When aegisd is watching us, our verdict is only a couple of loads away.
+    if (aegis_daemon_has_debugger(&has) == 0) {
+        return has;
+    }
+
+    heuristics = aegis_heuristics();
+
+    if ((heuristics & AEGIS_HEURISTIC_ANCESTRY) && aegis_ancestry_has_tracer()) {
+        return 1;
+    }
+
+    // INFO(Rafael): Self-trapping costs a couple of syscalls, way cheaper than forking.
+    if ((heuristics & AEGIS_HEURISTIC_SELFTRAP) && aegis_selftrap_has_tracer()) {
+        return 1;
+    }
+
+    if ((heuristics & AEGIS_HEURISTIC_PROCFS) == 0) {
+        return 0;
+    }
+
+    pid = getpid();
 
     fflush(stdout);
     fflush(stdin);
     fflush(stderr);
 
-    if (fork() == 0) {
-        snprintf(proc_filepath, sizeof(proc_filepath) - 2, "/proc/%d/stat", pid);
-        if ((fd = open(proc_filepath, O_RDONLY)) != -1) {
-            memset(proc_buf, 0, sizeof(proc_buf));
-            proc_buf_size = read(fd, proc_buf, sizeof(proc_buf) - 2);
-            close(fd);
-            if (proc_buf_size > -1 && (bp = strstr(proc_buf, ")")) != NULL) {
-                has = ((bp + 2) < bp_end && bp[2] == 't');
-            }
+    // INFO(Rafael): Not vfork(), the probing child calls into libc. Our fork handlers only reset state.
+    if ((cpid = fork()) == 0) {
+        _exit(aegis_procfs_has_tracer(pid));
+    } else if (cpid == -1) {
+        return 0;
+    }
+
+    // INFO(Rafael): Only our own probing child is reaped, children of the application are none of our business.
+    while (waitpid(cpid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return 0;
         }
-        if (!has) {
-            snprintf(proc_filepath, sizeof(proc_filepath) - 2, "/proc/%d/stack", pid);
-            if ((fd = open(proc_filepath, O_RDONLY)) != -1) {
-                memset(proc_buf, 0, sizeof(proc_buf));
-                proc_buf_size = read(fd, proc_buf, sizeof(proc_buf) - 2);
-                close(fd);
-                has = (proc_buf_size >= 11 && strstr(proc_buf, "ptrace_stop") != NULL) ||
-                      (proc_buf_size >= 15 && strstr(proc_buf, "tracesys_phase2") != NULL);
+    }
+
+    return (WIFEXITED(status) && WEXITSTATUS(status) != 0);
+}
+
+int aegis_set_heuristics(const unsigned int heuristics) {
+    if ((heuristics & ~AEGIS_HEURISTICS_ALL) != 0) {
+        return 1;
+    }
+    __atomic_store_n(&g_aegis_heuristics, heuristics, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int aegis_wait_for_debugger(const int timeout_ms) {
+    pid_t pid = getpid();
+    struct pollfd fds[2];
+    nfds_t fds_nr = 1;
+    struct itimerspec probe_sched;
+    struct timespec now, deadline;
+    int poll_timeout = -1;
+    int probe_interval_ms = AEGIS_WAIT_PROBE_INTERVAL_MSECS;
+    uint64_t expirations;
+    int has = aegis_has_debugger();
+
+    if (has) {
+        return has;
+    }
+
+    if ((fds[0].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) == -1) {
+        return 0;
+    }
+    fds[0].events = POLLIN;
+
+    // INFO(Rafael): With the proc connector (it requires CAP_NET_ADMIN) the kernel wakes us up when
+    //               somebody ptraces us, in this case the timer is only a safety net for lost events.
+    if ((fds[1].fd = aegis_proc_connector_open()) != -1) {
+        fds[1].events = POLLIN;
+        fds_nr = 2;
+        probe_interval_ms = AEGIS_WAIT_SAFETY_PROBE_INTERVAL_MSECS;
+    }
+
+    probe_sched.it_interval.tv_sec = probe_interval_ms / 1000;
+    probe_sched.it_interval.tv_nsec = (probe_interval_ms % 1000) * 1000000L;
+    probe_sched.it_value = probe_sched.it_interval;
+    timerfd_settime(fds[0].fd, 0, &probe_sched, NULL);
+
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while (!has) {
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            poll_timeout = (int)((deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000L);
+            if (poll_timeout <= 0) {
+                break;
             }
         }
-        exit(has);
-    } else {
-        wait(&has);
+
+        if (poll(fds, fds_nr, poll_timeout) <= 0) {
+            continue;
+        }
+
+        if (fds_nr > 1 && (fds[1].revents & POLLIN) && aegis_proc_connector_has_ptrace(fds[1].fd, pid)) {
+            has = 1;
+        }
+
+        if (!has && (fds[0].revents & POLLIN) && read(fds[0].fd, &expirations, sizeof(expirations)) > 0) {
+            has = aegis_wait_probe(pid);
+        }
+    }
+
+    if (fds_nr > 1) {
+        close(fds[1].fd);
+    }
+
+    close(fds[0].fd);
+
+    return has;
+}
+
+static unsigned int aegis_heuristics(void) {
+    unsigned int heuristics = aegis_config_get()->heuristics;
+    // INFO(Rafael): What operators configure beats what was compiled in.
+    return (heuristics != AEGIS_CONFIG_HEURISTICS_UNSET) ? heuristics :
+                                                           __atomic_load_n(&g_aegis_heuristics, __ATOMIC_RELAXED);
+}
+
+static int aegis_wait_probe(const pid_t pid) {
+    // INFO(Rafael): Reading TracerPid costs one read, the whole probe costs a fork.
+    //               Let's only fork when our status is telling that something has changed.
+    return (aegis_procfs_tracer_pid(pid) != 0 && aegis_has_debugger());
+}
+
+static int aegis_proc_connector_open(void) {
+    struct sockaddr_nl addr;
+    struct __attribute__((aligned(NLMSG_ALIGNTO))) {
+        struct nlmsghdr hdr;
+        struct __attribute__((__packed__)) {
+            struct cn_msg msg;
+            enum proc_cn_mcast_op op;
+        } body;
+    } req;
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_CONNECTOR);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+
+    memset(&req, 0, sizeof(req));
+    req.hdr.nlmsg_len = sizeof(req);
+    req.hdr.nlmsg_type = NLMSG_DONE;
+    req.body.msg.id.idx = CN_IDX_PROC;
+    req.body.msg.id.val = CN_VAL_PROC;
+    req.body.msg.len = sizeof(enum proc_cn_mcast_op);
+    req.body.op = PROC_CN_MCAST_LISTEN;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        send(fd, &req, sizeof(req), 0) != sizeof(req)) {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+static int aegis_proc_connector_has_ptrace(const int fd, const pid_t pid) {
+    char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *hdr;
+    struct cn_msg *msg;
+    struct proc_event *event;
+    ssize_t buf_size;
+    int has = 0;
+
+    while (!has && (buf_size = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        for (hdr = (struct nlmsghdr *)buf; !has && NLMSG_OK(hdr, buf_size); hdr = NLMSG_NEXT(hdr, buf_size)) {
+            msg = (struct cn_msg *)NLMSG_DATA(hdr);
+            event = (struct proc_event *)msg->data;
+            has = (event->what == PROC_EVENT_PTRACE &&
+                   event->event_data.ptrace.process_tgid == pid &&
+                   event->event_data.ptrace.tracer_tgid != 0);
+        }
     }
 
-    return (has != 0);
+    return has;
 }
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <aegis.h>
+#include <native/linux/aegis_procfs.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct aegis_procfs_root {
+    struct aegis_procfs_root *next;
+    char path[AEGIS_PROCFS_ROOT_SIZE];
+};
+
+static struct aegis_procfs_root g_aegis_procfs_default_root = { NULL, AEGIS_PROCFS_DEFAULT_ROOT };
+
+// INFO(Rafael): Every root ever published stays on this list, a probe can still be reading an old one. They are
+//               never written again nor freed, only looked up, so setting a known root again costs nothing.
+static struct aegis_procfs_root *g_aegis_procfs_roots = &g_aegis_procfs_default_root;
+
+static const char *g_aegis_procfs_root = g_aegis_procfs_default_root.path;
+
+static unsigned int g_aegis_procfs_root_generation = 0;
+
+static ssize_t aegis_procfs_read(const pid_t pid, const char *entry, char *buf, const size_t buf_size);
+
+int aegis_set_procfs_root(const char *root) {
+    struct aegis_procfs_root *known;
+
+    if (root == NULL) {
+        root = AEGIS_PROCFS_DEFAULT_ROOT;
+    }
+
+    if (*root == 0 || strlen(root) >= sizeof(known->path)) {
+        return 1;
+    }
+
+    for (known = __atomic_load_n(&g_aegis_procfs_roots, __ATOMIC_ACQUIRE);
+         known != NULL && strcmp(known->path, root) != 0; known = known->next)
+        ;
+
+    if (known == NULL) {
+        if ((known = (struct aegis_procfs_root *)calloc(1, sizeof(struct aegis_procfs_root))) == NULL) {
+            return 1;
+        }
+        strncpy(known->path, root, sizeof(known->path) - 1);
+        known->next = __atomic_load_n(&g_aegis_procfs_roots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&g_aegis_procfs_roots, &known->next, known, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    __atomic_store_n(&g_aegis_procfs_root, known->path, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&g_aegis_procfs_root_generation, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+unsigned int aegis_procfs_root_generation(void) {
+    return __atomic_load_n(&g_aegis_procfs_root_generation, __ATOMIC_ACQUIRE);
+}
+
+int aegis_procfs_has_tracer(const pid_t pid) {
+    int has = 0;
+    char proc_buf[1024];
+    ssize_t proc_buf_size = 0;
+
+    if ((proc_buf_size = aegis_procfs_read(pid, "stat", proc_buf, sizeof(proc_buf))) > 0) {
+        has = (aegis_procfs_parse_stat_state(proc_buf, proc_buf_size) == 't');
+    }
+
+    if (!has && (proc_buf_size = aegis_procfs_read(pid, "stack", proc_buf, sizeof(proc_buf))) > 0) {
+        has = aegis_procfs_parse_stack_has_ptrace(proc_buf, proc_buf_size);
+    }
+
+    return has;
+}
+
+pid_t aegis_procfs_tracer_pid(const pid_t pid) {
+    char proc_buf[4096];
+    ssize_t proc_buf_size = aegis_procfs_read(pid, "status", proc_buf, sizeof(proc_buf));
+    return (proc_buf_size > 0) ? aegis_procfs_parse_status_tracer_pid(proc_buf, proc_buf_size) : 0;
+}
+
+int aegis_procfs_stat_lineage(const pid_t pid, pid_t *ppid, unsigned long long *starttime,
+                              char *comm, const size_t comm_size) {
+    char proc_buf[1024];
+    ssize_t proc_buf_size = aegis_procfs_read(pid, "stat", proc_buf, sizeof(proc_buf));
+    return (proc_buf_size > 0) ? aegis_procfs_parse_stat_lineage(proc_buf, proc_buf_size, ppid, starttime,
+                                                                 comm, comm_size) : 1;
+}
+
+int aegis_procfs_exe_name(const pid_t pid, char *name, const size_t name_size) {
+    char proc_filepath[AEGIS_PROCFS_ROOT_SIZE + 64], exe_path[4096], *basename;
+    ssize_t size;
+
+    snprintf(proc_filepath, sizeof(proc_filepath), "%s/%d/exe",
+             __atomic_load_n(&g_aegis_procfs_root, __ATOMIC_ACQUIRE), pid);
+
+    // INFO(Rafael): It fails for processes of other users, that is why callers need comm as plan B.
+    if ((size = readlink(proc_filepath, exe_path, sizeof(exe_path) - 1)) <= 0) {
+        return 1;
+    }
+
+    exe_path[size] = 0;
+
+    basename = strrchr(exe_path, '/');
+    basename = (basename != NULL) ? basename + 1 : exe_path;
+
+    if (*basename == 0 || strlen(basename) >= name_size) {
+        return 1;
+    }
+
+    strncpy(name, basename, name_size - 1);
+    name[name_size - 1] = 0;
+
+    return 0;
+}
+
+char aegis_procfs_parse_stat_state(const char *stat, const size_t stat_size) {
+    const char *bp;
+
+    // INFO(Rafael): Comm is the only free text in stat and it can have ')' (or even ") t (") on it.
+    //               The real closing parenthesis is the last one.
+    if (stat_size == 0 || (bp = strrchr(stat, ')')) == NULL) {
+        return 0;
+    }
+
+    bp++;
+
+    if ((bp + 1) >= stat + stat_size || *bp != ' ') {
+        return 0;
+    }
+
+    return bp[1];
+}
+
+int aegis_procfs_parse_stack_has_ptrace(const char *stack, const size_t stack_size) {
+    return (stack_size >= 11 && strstr(stack, "ptrace_stop") != NULL) ||
+           (stack_size >= 15 && strstr(stack, "tracesys_phase2") != NULL);
+}
+
+pid_t aegis_procfs_parse_status_tracer_pid(const char *status, const size_t status_size) {
+    const char *bp;
+
+    // INFO(Rafael): Name is the first line, so a process named "TracerPid:" cannot fool a search for the
+    //               beginning of a line.
+    if (status_size < 11 || (bp = strstr(status, "\nTracerPid:")) == NULL) {
+        return 0;
+    }
+
+    return (pid_t)strtol(bp + 11, NULL, 10);
+}
+
+int aegis_procfs_parse_stat_lineage(const char *stat, const size_t stat_size,
+                                    pid_t *ppid, unsigned long long *starttime, char *comm, const size_t comm_size) {
+    const char *comm_begin, *comm_end, *bp;
+    char *end;
+    unsigned long long value;
+    size_t size;
+    int field;
+
+    if (stat_size == 0 || (comm_begin = strchr(stat, '(')) == NULL ||
+        (comm_end = strrchr(stat, ')')) == NULL || comm_end < comm_begin) {
+        return 1;
+    }
+
+    if (comm != NULL && comm_size > 0) {
+        size = comm_end - comm_begin - 1;
+        size = (size < comm_size) ? size : comm_size - 1;
+        memcpy(comm, comm_begin + 1, size);
+        comm[size] = 0;
+    }
+
+    if ((comm_end + 3) >= stat + stat_size) {
+        return 1;
+    }
+
+    bp = comm_end + 3;
+
+    value = strtoull(bp, &end, 10);
+    if (end == bp) {
+        return 1;
+    }
+
+    *ppid = (pid_t)value;
+
+    for (field = 4, bp = end; field < AEGIS_PROCFS_STAT_STARTTIME_FIELD - 1 && bp != NULL; field++) {
+        bp = strchr(bp + 1, ' ');
+    }
+
+    if (bp == NULL) {
+        return 1;
+    }
+
+    value = strtoull(bp, &end, 10);
+    if (end == bp) {
+        return 1;
+    }
+
+    *starttime = value;
+
+    return 0;
+}
+
+static ssize_t aegis_procfs_read(const pid_t pid, const char *entry, char *buf, const size_t buf_size) {
+    char proc_filepath[AEGIS_PROCFS_ROOT_SIZE + 64];
+    ssize_t size = -1;
+    int fd;
+
+    snprintf(proc_filepath, sizeof(proc_filepath), "%s/%d/%s",
+             __atomic_load_n(&g_aegis_procfs_root, __ATOMIC_ACQUIRE), pid, entry);
+
+    if ((fd = open(proc_filepath, O_RDONLY | O_CLOEXEC)) != -1) {
+        size = read(fd, buf, buf_size - 1);
+        close(fd);
+    }
+
+    buf[(size > 0) ? size : 0] = 0;
+
+    return size;
+}
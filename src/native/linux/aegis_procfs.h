@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#ifndef AEGIS_NATIVE_LINUX_AEGIS_PROCFS_H
+#define AEGIS_NATIVE_LINUX_AEGIS_PROCFS_H 1
+
+#include <sys/types.h>
+
+#define AEGIS_PROCFS_ROOT_SIZE 1024
+
+#define AEGIS_PROCFS_STAT_STARTTIME_FIELD 22
+
+int aegis_procfs_has_tracer(const pid_t pid);
+
+pid_t aegis_procfs_tracer_pid(const pid_t pid);
+
+int aegis_procfs_stat_lineage(const pid_t pid, pid_t *ppid, unsigned long long *starttime,
+                              char *comm, const size_t comm_size);
+
+int aegis_procfs_exe_name(const pid_t pid, char *name, const size_t name_size);
+
+unsigned int aegis_procfs_root_generation(void);
+
+// INFO(Rafael): Parsers take buffers as read from procfs, they must be NUL terminated at [size].
+
+char aegis_procfs_parse_stat_state(const char *stat, const size_t stat_size);
+
+int aegis_procfs_parse_stack_has_ptrace(const char *stack, const size_t stack_size);
+
+pid_t aegis_procfs_parse_status_tracer_pid(const char *status, const size_t status_size);
+
+int aegis_procfs_parse_stat_lineage(const char *stat, const size_t stat_size,
+                                    pid_t *ppid, unsigned long long *starttime, char *comm, const size_t comm_size);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <aegis.h>
+#include <native/linux/aegis_selftrap.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+struct aegis_selftrap_ctx {
+    struct sigaction old_action;
+    struct aegis_probe_stats stats;
+    int action_lock;
+    pthread_mutex_t mtx;
+};
+
+static struct aegis_selftrap_ctx g_aegis_selftrap = { { { 0 } }, { 0 }, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// INFO(Rafael): Per thread, a SIGTRAP hitting another thread during our probe is not ours.
+static __thread volatile sig_atomic_t g_aegis_selftrap_is_armed = 0;
+
+static __thread volatile sig_atomic_t g_aegis_selftrap_has_run = 0;
+
+static __thread volatile sig_atomic_t g_aegis_selftrap_holds_action_lock = 0;
+
+static pthread_once_t g_aegis_selftrap_atfork_once = PTHREAD_ONCE_INIT;
+
+static void aegis_selftrap_atfork_prepare(void);
+
+static void aegis_selftrap_atfork_parent(void);
+
+static void aegis_selftrap_atfork_child(void);
+
+static void aegis_selftrap_register_atfork(void);
+
+static void aegis_selftrap_handler(int signo, siginfo_t *info, void *context);
+
+static void aegis_selftrap_lock_action(void);
+
+static void aegis_selftrap_unlock_action(void);
+
+static uint64_t aegis_selftrap_now(void);
+
+int aegis_selftrap_has_tracer(void) {
+    struct sigaction action;
+    sigset_t trap_set, old_set;
+    uint64_t start = aegis_selftrap_now(), elapsed;
+    int has = 0;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = aegis_selftrap_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+
+    sigemptyset(&trap_set);
+    sigaddset(&trap_set, SIGTRAP);
+
+    pthread_once(&g_aegis_selftrap_atfork_once, aegis_selftrap_register_atfork);
+
+    pthread_mutex_lock(&g_aegis_selftrap.mtx);
+
+    // INFO(Rafael): Swapping both actions at once, a one-shot handler fired just before by another thread
+    //               is seen as gone. Traps of other threads wait for the old action to be written here.
+    aegis_selftrap_lock_action();
+    if (sigaction(SIGTRAP, &action, &g_aegis_selftrap.old_action) != 0) {
+        aegis_selftrap_unlock_action();
+        pthread_mutex_unlock(&g_aegis_selftrap.mtx);
+        return 0;
+    }
+    aegis_selftrap_unlock_action();
+
+    // INFO(Rafael): A blocked SIGTRAP raised by a trap instruction would kill us.
+    pthread_sigmask(SIG_UNBLOCK, &trap_set, &old_set);
+
+    g_aegis_selftrap_has_run = 0;
+    g_aegis_selftrap_is_armed = 1;
+
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("int3" : : : "memory");
+#else
+    raise(SIGTRAP);
+#endif
+
+    g_aegis_selftrap_is_armed = 0;
+
+    // INFO(Rafael): Our handler did not run, someone has swallowed the trap. Only a tracer does it.
+    has = !g_aegis_selftrap_has_run;
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    aegis_selftrap_lock_action();
+    sigaction(SIGTRAP, &g_aegis_selftrap.old_action, NULL);
+    aegis_selftrap_unlock_action();
+
+    elapsed = aegis_selftrap_now() - start;
+    g_aegis_selftrap.stats.last_nsecs = elapsed;
+    if (elapsed > g_aegis_selftrap.stats.max_nsecs) {
+        g_aegis_selftrap.stats.max_nsecs = elapsed;
+    }
+    g_aegis_selftrap.stats.total_nsecs += elapsed;
+    g_aegis_selftrap.stats.probes_nr++;
+
+    pthread_mutex_unlock(&g_aegis_selftrap.mtx);
+
+    return has;
+}
+
+void aegis_get_selftrap_stats(struct aegis_probe_stats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&g_aegis_selftrap.mtx);
+    *stats = g_aegis_selftrap.stats;
+    pthread_mutex_unlock(&g_aegis_selftrap.mtx);
+}
+
+static void aegis_selftrap_handler(int signo, siginfo_t *info, void *context) {
+    struct sigaction old_action, current_action;
+    sigset_t trap_set, saved_set;
+    const int is_locking = !g_aegis_selftrap_holds_action_lock;
+
+    if (g_aegis_selftrap_is_armed) {
+        g_aegis_selftrap_has_run = 1;
+        return;
+    }
+
+    // INFO(Rafael): On the probing thread a trap can only come on the way out of its sigaction() call,
+    //               the old action is already written and the lock is ours.
+    if (is_locking) {
+        aegis_selftrap_lock_action();
+    }
+
+    old_action = g_aegis_selftrap.old_action;
+
+    if (old_action.sa_handler == SIG_DFL) {
+        sigaction(SIGTRAP, &old_action, NULL);
+        raise(SIGTRAP);
+    } else if (old_action.sa_handler != SIG_IGN && (old_action.sa_flags & SA_RESETHAND)) {
+        // INFO(Rafael): A one-shot handler is gone once called, what is restored when the probe ends
+        //               must be the default action. If it was restored meanwhile, it is reset right here.
+        g_aegis_selftrap.old_action.sa_handler = SIG_DFL;
+        g_aegis_selftrap.old_action.sa_flags &= ~(SA_SIGINFO | SA_RESETHAND);
+        if (sigaction(SIGTRAP, NULL, &current_action) == 0 &&
+            current_action.sa_sigaction != aegis_selftrap_handler) {
+            sigaction(SIGTRAP, &g_aegis_selftrap.old_action, NULL);
+        }
+    }
+
+    if (is_locking) {
+        aegis_selftrap_unlock_action();
+    }
+
+    if (old_action.sa_handler == SIG_DFL || old_action.sa_handler == SIG_IGN) {
+        return;
+    }
+
+    pthread_sigmask(SIG_BLOCK, &old_action.sa_mask, &saved_set);
+
+    if (old_action.sa_flags & SA_NODEFER) {
+        sigemptyset(&trap_set);
+        sigaddset(&trap_set, SIGTRAP);
+        pthread_sigmask(SIG_UNBLOCK, &trap_set, NULL);
+    }
+
+    if (old_action.sa_flags & SA_SIGINFO) {
+        old_action.sa_sigaction(signo, info, context);
+    } else {
+        old_action.sa_handler(signo);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &saved_set, NULL);
+}
+
+static void aegis_selftrap_lock_action(void) {
+    while (__atomic_exchange_n(&g_aegis_selftrap.action_lock, 1, __ATOMIC_ACQUIRE))
+        ;
+    g_aegis_selftrap_holds_action_lock = 1;
+}
+
+static void aegis_selftrap_unlock_action(void) {
+    g_aegis_selftrap_holds_action_lock = 0;
+    __atomic_store_n(&g_aegis_selftrap.action_lock, 0, __ATOMIC_RELEASE);
+}
+
+static void aegis_selftrap_atfork_prepare(void) {
+    pthread_mutex_lock(&g_aegis_selftrap.mtx);
+}
+
+static void aegis_selftrap_atfork_parent(void) {
+    pthread_mutex_unlock(&g_aegis_selftrap.mtx);
+}
+
+static void aegis_selftrap_atfork_child(void) {
+    memset(&g_aegis_selftrap.stats, 0, sizeof(g_aegis_selftrap.stats));
+    g_aegis_selftrap.action_lock = 0;
+    pthread_mutex_unlock(&g_aegis_selftrap.mtx);
+}
+
+static void aegis_selftrap_register_atfork(void) {
+    pthread_atfork(aegis_selftrap_atfork_prepare, aegis_selftrap_atfork_parent, aegis_selftrap_atfork_child);
+}
+
+static uint64_t aegis_selftrap_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#ifndef AEGIS_NATIVE_LINUX_AEGIS_SELFTRAP_H
+#define AEGIS_NATIVE_LINUX_AEGIS_SELFTRAP_H 1
+
+#include <stdint.h>
+
+int aegis_selftrap_has_tracer(void);
+
+#endif
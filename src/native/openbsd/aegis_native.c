@@ -12,28 +12,22 @@
 #include <sys/proc.h>
 #include <sys/sysctl.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include <pthread.h>
 
 int aegis_has_debugger(void) {
-    pid_t pid = getpid(), cpid;
+    pid_t pid = getpid();
     struct kinfo_proc kp;
     size_t kp_len = sizeof(kp);
     int pidinfo_args[6] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, (int)pid, kp_len, 1 };
     int is = 0;
 
-    fflush(stdout);
-    fflush(stdin);
-    fflush(stderr);
+#if !defined(CGO)
+    aegis_rearm();
+#endif
 
-    if ((cpid = fork()) == 0) {
-        if (sysctl(pidinfo_args, nitems(pidinfo_args),
-                   &kp, &kp_len, NULL, 0) == 0) {
-            is = (kp.p_stat == SSTOP || (kp.p_psflags & PS_TRACED));
-        }
-        exit(is);
-    } else {
-        waitpid(cpid, &is, 0);
+    if (sysctl(pidinfo_args, nitems(pidinfo_args),
+               &kp, &kp_len, NULL, 0) == 0) {
+        is = (kp.p_stat == SSTOP || (kp.p_psflags & PS_TRACED));
     }
-    return (is != 0);
+    return is;
 }
@@ -6,39 +6,188 @@
  * LICENSE file in the root directory of this source tree.
  */
 #include <aegis.h>
+#include <native/pthread/aegis_gorgon.h>
+#include <native/pthread/aegis_secrets.h>
+#include <native/pthread/aegis_heartbeat.h>
+#include <native/pthread/aegis_responder.h>
+#if defined(__linux__)
+# include <native/linux/aegis_config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
 #include <pthread.h>
 
 #if defined(CGO)
 # error You are compiling it from Cgo. Aegis uses native concurrency stuff from go. Do not complicate stuff buddy.
 #endif
 
+#define AEGIS_PROTECT_STRIPES_NR 16
+
+#define AEGIS_GORGON_PARKED_USECS 100000
+
 struct aegis_gorgon_exec_ctx {
     pthread_t thread;
     aegis_gorgon_exit_test_func should_exit;
     void *should_exit_args;
     aegis_gorgon_on_debugger_func on_debugger;
     void *on_debugger_args;
+    int running_nr;
+    int should_respawn;
+};
+
+struct aegis_protect_stripe {
+    long depth;
+    char pad[64 - sizeof(long)];
+} __attribute__((aligned(64)));
+
+struct aegis_protect_ctx {
+    struct aegis_protect_stripe stripes[AEGIS_PROTECT_STRIPES_NR];
+    unsigned int next_stripe;
+    int gorgon_is_idle;
+    unsigned int active_usecs;
+    unsigned int idle_usecs;
+    uint64_t wakeups_nr;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    struct aegis_probe_stats stats;
+    pthread_mutex_t stats_mtx;
 };
 
-static struct aegis_gorgon_exec_ctx g_aegis_gorgon = { 0, NULL, NULL, NULL, NULL };
+static struct aegis_gorgon_exec_ctx g_aegis_gorgon = { 0, NULL, NULL, NULL, NULL, 0, 0 };
+
+static struct aegis_protect_ctx g_aegis_protect = { { { 0 } }, 0, 0, 1, 1, 0,
+                                                    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                                    { 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+static __thread int g_aegis_protect_stripe = -1;
+
+static pthread_once_t g_aegis_gorgon_atfork_once = PTHREAD_ONCE_INIT;
+
+static int g_aegis_needs_rearm = 0;
 
 static void *aegis_gorgon_routine(void *args);
 
+static int aegis_protect_is_active(void);
+
+static void aegis_gorgon_idle(const unsigned int idle_usecs);
+
+static void aegis_gorgon_sleep(const unsigned int usecs);
+
+static int aegis_gorgon_probe(struct aegis_heartbeat_watcher *watcher);
+
+static struct aegis_protect_stripe *aegis_protect_get_stripe(void);
+
+static void aegis_gorgon_atfork_prepare(void);
+
+static void aegis_gorgon_atfork_parent(void);
+
+static void aegis_gorgon_atfork_child(void);
+
+static void aegis_gorgon_register_atfork(void);
+
 int aegis_set_gorgon(aegis_gorgon_exit_test_func exit_test, void *exit_test_args,
                      aegis_gorgon_on_debugger_func on_debugger, void *on_debugger_args) {
     pthread_attr_t gorgon_attr;
     int err = 1;
+    aegis_gorgon_atfork_init();
+    aegis_rearm();
     if ((err = pthread_attr_init(&gorgon_attr)) == 0) {
         g_aegis_gorgon.should_exit = exit_test;
         g_aegis_gorgon.should_exit_args = exit_test_args;
         g_aegis_gorgon.on_debugger = (on_debugger != NULL) ? on_debugger : aegis_default_on_debugger;
         g_aegis_gorgon.on_debugger_args = on_debugger_args;
-        err = pthread_create(&g_aegis_gorgon.thread, &gorgon_attr, aegis_gorgon_routine, &g_aegis_gorgon);
+        __atomic_fetch_add(&g_aegis_gorgon.running_nr, 1, __ATOMIC_RELAXED);
+        if ((err = pthread_create(&g_aegis_gorgon.thread, &gorgon_attr, aegis_gorgon_routine, &g_aegis_gorgon)) != 0) {
+            __atomic_fetch_sub(&g_aegis_gorgon.running_nr, 1, __ATOMIC_RELAXED);
+        }
     }
     return err;
 }
 
+int aegis_set_gorgon_probe_rate(const unsigned int active_usecs, const unsigned int idle_usecs) {
+    if (active_usecs == 0 || idle_usecs == 0) {
+        return 1;
+    }
+    __atomic_store_n(&g_aegis_protect.active_usecs, active_usecs, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_aegis_protect.idle_usecs, idle_usecs, __ATOMIC_RELAXED);
+    aegis_wake_gorgon();
+    return 0;
+}
+
+void aegis_wake_gorgon(void) {
+    pthread_mutex_lock(&g_aegis_protect.mtx);
+    g_aegis_protect.wakeups_nr++;
+    pthread_cond_broadcast(&g_aegis_protect.cond);
+    pthread_mutex_unlock(&g_aegis_protect.mtx);
+}
+
+void aegis_get_gorgon_stats(struct aegis_probe_stats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&g_aegis_protect.stats_mtx);
+    *stats = g_aegis_protect.stats;
+    pthread_mutex_unlock(&g_aegis_protect.stats_mtx);
+}
+
+void aegis_protect_begin(void) {
+    int is_idle = 1;
+    aegis_rearm();
+    __atomic_fetch_add(&aegis_protect_get_stripe()->depth, 1, __ATOMIC_SEQ_CST);
+    // INFO(Rafael): Pairs with the store of gorgon_is_idle in aegis_gorgon_idle(). Both are seq_cst,
+    //               so either we see the gorgon idling here or it sees our depth before waiting.
+    //               Only the thread that flips the flag pays for waking the gorgon up.
+    if (__atomic_load_n(&g_aegis_protect.gorgon_is_idle, __ATOMIC_SEQ_CST) &&
+        __atomic_compare_exchange_n(&g_aegis_protect.gorgon_is_idle, &is_idle, 0, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&g_aegis_protect.mtx);
+        pthread_cond_signal(&g_aegis_protect.cond);
+        pthread_mutex_unlock(&g_aegis_protect.mtx);
+    }
+}
+
+void aegis_protect_end(void) {
+    __atomic_fetch_sub(&aegis_protect_get_stripe()->depth, 1, __ATOMIC_RELEASE);
+}
+
+void aegis_rearm(void) {
+    if (!__atomic_load_n(&g_aegis_needs_rearm, __ATOMIC_RELAXED) ||
+        !__atomic_exchange_n(&g_aegis_needs_rearm, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    aegis_secrets_rearm();
+    aegis_responder_rearm();
+    aegis_heartbeat_rearm();
+    if (__atomic_exchange_n(&g_aegis_gorgon.should_respawn, 0, __ATOMIC_ACQ_REL)) {
+        __atomic_fetch_add(&g_aegis_gorgon.running_nr, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&g_aegis_gorgon.thread, NULL, aegis_gorgon_routine, &g_aegis_gorgon) != 0) {
+            __atomic_fetch_sub(&g_aegis_gorgon.running_nr, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void aegis_gorgon_handle_detection(const int source, aegis_gorgon_on_debugger_func on_debugger, void *on_debugger_args,
+                                   const uint64_t detected_at) {
+#if defined(__linux__)
+    int action = aegis_config_get()->on_debugger;
+    if (action == AEGIS_CONFIG_ON_DEBUGGER_IGNORE) {
+        return;
+    }
+#endif
+    aegis_secrets_wipe_on_detection(detected_at);
+#if defined(__linux__)
+    if (action == AEGIS_CONFIG_ON_DEBUGGER_EXIT) {
+        exit(1);
+    } else if (action == AEGIS_CONFIG_ON_DEBUGGER_ABORT) {
+        abort();
+    }
+#endif
+    aegis_responder_dispatch(source, on_debugger, on_debugger_args, detected_at);
+}
+
 static void *aegis_gorgon_routine(void *args) {
     int stop = 0;
     struct aegis_gorgon_exec_ctx *exec = (struct aegis_gorgon_exec_ctx *)args;
@@ -46,14 +195,170 @@ static void *aegis_gorgon_routine(void *args) {
     void *exit_args = exec->should_exit_args;
     aegis_gorgon_on_debugger_func on_debugger = exec->on_debugger;
     void *on_debugger_args = exec->on_debugger_args;
+    unsigned int active_usecs, idle_usecs;
+    struct aegis_heartbeat *heartbeat = aegis_heartbeat_gorgon_register();
+    struct aegis_heartbeat_watcher watcher;
+    uint64_t work_started_at, detected_at, work_nsecs, work_peak_nsecs = 0, handling_nsecs;
+#if defined(__linux__)
+    const struct aegis_config *config;
+#endif
+    memset(&watcher, 0, sizeof(watcher));
     while (!stop) {
-        if (aegis_has_debugger()) {
-            on_debugger(on_debugger_args);
+        work_started_at = aegis_secrets_now();
+        handling_nsecs = 0;
+        active_usecs = __atomic_load_n(&g_aegis_protect.active_usecs, __ATOMIC_RELAXED);
+        idle_usecs = __atomic_load_n(&g_aegis_protect.idle_usecs, __ATOMIC_RELAXED);
+#if defined(__linux__)
+        config = aegis_config_get();
+        if (config->gorgon_active_usecs != 0) {
+            active_usecs = config->gorgon_active_usecs;
+        }
+        if (config->gorgon_idle_usecs != 0) {
+            idle_usecs = config->gorgon_idle_usecs;
+        }
+#endif
+        if (idle_usecs != AEGIS_GORGON_SLEEP_WHEN_IDLE || aegis_protect_is_active()) {
+            if (aegis_gorgon_probe(&watcher)) {
+                detected_at = aegis_secrets_now();
+                aegis_heartbeat_park(heartbeat);
+                aegis_gorgon_handle_detection(AEGIS_RESPONDER_SOURCE_GORGON, on_debugger, on_debugger_args,
+                                              detected_at);
+                handling_nsecs = aegis_secrets_now() - detected_at;
+            }
         }
         if (should_exit != NULL) {
             stop = should_exit(exit_args);
         }
-        usleep(1);
+        if (!stop) {
+            work_nsecs = aegis_secrets_now() - work_started_at - handling_nsecs;
+            work_peak_nsecs -= work_peak_nsecs / 8;
+            if (work_nsecs > work_peak_nsecs) {
+                work_peak_nsecs = work_nsecs;
+            }
+            if (idle_usecs == active_usecs || aegis_protect_is_active()) {
+                aegis_heartbeat_gorgon_beat(heartbeat, active_usecs, work_peak_nsecs);
+                aegis_gorgon_sleep(active_usecs);
+            } else {
+                aegis_heartbeat_gorgon_beat(heartbeat, idle_usecs, work_peak_nsecs);
+                aegis_gorgon_idle(idle_usecs);
+            }
+        }
     }
+    aegis_heartbeat_gorgon_unregister(heartbeat);
+    __atomic_fetch_sub(&exec->running_nr, 1, __ATOMIC_RELAXED);
     return NULL;
 }
+
+static int aegis_protect_is_active(void) {
+    long depth = 0;
+    size_t s;
+    for (s = 0; s < AEGIS_PROTECT_STRIPES_NR; s++) {
+        depth += __atomic_load_n(&g_aegis_protect.stripes[s].depth, __ATOMIC_SEQ_CST);
+    }
+    return (depth > 0);
+}
+
+static void aegis_gorgon_idle(const unsigned int idle_usecs) {
+    struct timespec deadline;
+    const unsigned int usecs = (idle_usecs == AEGIS_GORGON_SLEEP_WHEN_IDLE) ? AEGIS_GORGON_PARKED_USECS : idle_usecs;
+    uint64_t wakeups_nr;
+
+    pthread_mutex_lock(&g_aegis_protect.mtx);
+
+    __atomic_store_n(&g_aegis_protect.gorgon_is_idle, 1, __ATOMIC_SEQ_CST);
+
+    wakeups_nr = g_aegis_protect.wakeups_nr;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += usecs / 1000000;
+    deadline.tv_nsec += (long)(usecs % 1000000) * 1000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // INFO(Rafael): Parked or not we go back to the routine once in a while, the exit test is checked there.
+    while (!aegis_protect_is_active() && wakeups_nr == g_aegis_protect.wakeups_nr) {
+        if (pthread_cond_timedwait(&g_aegis_protect.cond, &g_aegis_protect.mtx, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    __atomic_store_n(&g_aegis_protect.gorgon_is_idle, 0, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&g_aegis_protect.mtx);
+}
+
+static void aegis_gorgon_sleep(const unsigned int usecs) {
+    struct timespec req, rem;
+    req.tv_sec = usecs / 1000000;
+    req.tv_nsec = (long)(usecs % 1000000) * 1000L;
+    while (nanosleep(&req, &rem) == -1 && errno == EINTR) {
+        req = rem;
+    }
+}
+
+static int aegis_gorgon_probe(struct aegis_heartbeat_watcher *watcher) {
+    uint64_t started_at = aegis_secrets_now(), elapsed;
+    int has = aegis_has_debugger();
+    elapsed = aegis_secrets_now() - started_at;
+    pthread_mutex_lock(&g_aegis_protect.stats_mtx);
+    g_aegis_protect.stats.last_nsecs = elapsed;
+    if (elapsed > g_aegis_protect.stats.max_nsecs) {
+        g_aegis_protect.stats.max_nsecs = elapsed;
+    }
+    g_aegis_protect.stats.total_nsecs += elapsed;
+    g_aegis_protect.stats.probes_nr++;
+    pthread_mutex_unlock(&g_aegis_protect.stats_mtx);
+    return (has || aegis_heartbeat_gorgon_has_stalls(watcher));
+}
+
+static struct aegis_protect_stripe *aegis_protect_get_stripe(void) {
+    if (g_aegis_protect_stripe == -1) {
+        g_aegis_protect_stripe = (int)(__atomic_fetch_add(&g_aegis_protect.next_stripe, 1, __ATOMIC_RELAXED) %
+                                       AEGIS_PROTECT_STRIPES_NR);
+    }
+    return &g_aegis_protect.stripes[g_aegis_protect_stripe];
+}
+
+void aegis_gorgon_atfork_init(void) {
+    pthread_once(&g_aegis_gorgon_atfork_once, aegis_gorgon_register_atfork);
+}
+
+static void aegis_gorgon_atfork_prepare(void) {
+    aegis_heartbeat_atfork_prepare();
+    aegis_secrets_atfork_prepare();
+    aegis_responder_atfork_prepare();
+    pthread_mutex_lock(&g_aegis_protect.mtx);
+    pthread_mutex_lock(&g_aegis_protect.stats_mtx);
+}
+
+static void aegis_gorgon_atfork_parent(void) {
+    pthread_mutex_unlock(&g_aegis_protect.stats_mtx);
+    pthread_mutex_unlock(&g_aegis_protect.mtx);
+    aegis_responder_atfork_parent();
+    aegis_secrets_atfork_parent();
+    aegis_heartbeat_atfork_parent();
+}
+
+static void aegis_gorgon_atfork_child(void) {
+    static const pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    // INFO(Rafael): Fork handlers also run for every system() and popen(), so here state is only reset.
+    //               Threads are spawned again by aegis_rearm(), on the child's first call to us.
+    aegis_secrets_atfork_child();
+    aegis_heartbeat_atfork_child();
+    aegis_responder_atfork_child();
+    pthread_mutex_unlock(&g_aegis_protect.stats_mtx);
+    pthread_mutex_unlock(&g_aegis_protect.mtx);
+    g_aegis_protect.cond = cond;
+    g_aegis_protect.gorgon_is_idle = 0;
+    // INFO(Rafael): Protection depths are kept, thus scopes opened by other threads of our parent make us
+    //               probe more, never less.
+    g_aegis_gorgon.should_respawn = (g_aegis_gorgon.running_nr > 0);
+    g_aegis_gorgon.running_nr = 0;
+    g_aegis_needs_rearm = 1;
+}
+
+static void aegis_gorgon_register_atfork(void) {
+    pthread_atfork(aegis_gorgon_atfork_prepare, aegis_gorgon_atfork_parent, aegis_gorgon_atfork_child);
+}
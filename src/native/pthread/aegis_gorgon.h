@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#ifndef AEGIS_NATIVE_PTHREAD_AEGIS_GORGON_H
+#define AEGIS_NATIVE_PTHREAD_AEGIS_GORGON_H 1
+
+#include <aegis.h>
+#include <stdint.h>
+
+void aegis_gorgon_handle_detection(const int source, aegis_gorgon_on_debugger_func on_debugger, void *on_debugger_args,
+                                   const uint64_t detected_at);
+
+void aegis_gorgon_atfork_init(void);
+
+#endif
@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <aegis.h>
+#include <native/pthread/aegis_heartbeat.h>
+#include <native/pthread/aegis_gorgon.h>
+#include <native/pthread/aegis_responder.h>
+#include <native/pthread/aegis_secrets.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define AEGIS_HEARTBEAT_MONITORS_NR 16
+
+#define AEGIS_HEARTBEAT_SLACK_USECS 250000
+
+#define AEGIS_HEARTBEAT_PARKED ((uint64_t)-1)
+
+struct aegis_heartbeat {
+    unsigned long long beats;
+    char pad[64 - sizeof(unsigned long long)];
+} __attribute__((aligned(64)));
+
+struct aegis_heartbeat_slot {
+    // INFO(Rafael): Odd while the slot is in use, every (un)registration moves it.
+    uint32_t generation;
+    int is_monitor;
+    uint64_t stall_nsecs;
+    pthread_t owner;
+};
+
+struct aegis_heartbeat_ctx {
+    struct aegis_heartbeat beats[AEGIS_HEARTBEATS_NR];
+    struct aegis_heartbeat_slot slots[AEGIS_HEARTBEATS_NR];
+    size_t monitor_slots[AEGIS_HEARTBEAT_MONITORS_NR];
+    int is_ring_set;
+    int should_stop;
+    unsigned int monitors_nr;
+    unsigned int running_nr;
+    unsigned int rearm_monitors_nr;
+    unsigned int period_usecs;
+    aegis_gorgon_on_debugger_func on_stall;
+    void *on_stall_args;
+    pthread_mutex_t mtx;
+    pthread_cond_t stopped_cond;
+    pthread_mutex_t ring_mtx;
+};
+
+static struct aegis_heartbeat_ctx g_aegis_heartbeat = { { { 0 } }, { { 0 } }, { 0 }, 0, 0, 0, 0, 0, 0, NULL, NULL,
+                                                        PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                                        PTHREAD_MUTEX_INITIALIZER };
+
+static __thread int g_aegis_heartbeat_is_monitor = 0;
+
+static struct aegis_heartbeat *aegis_heartbeat_register_slot(const uint64_t stall_nsecs, const int is_monitor);
+
+static int aegis_heartbeat_is_stalled(const size_t s, struct aegis_heartbeat_watch *watch, const uint64_t now);
+
+static void aegis_heartbeat_set_stall(struct aegis_heartbeat *heartbeat, const uint64_t stall_nsecs);
+
+static void *aegis_heartbeat_monitor_routine(void *args);
+
+struct aegis_heartbeat *aegis_heartbeat_register(const unsigned int stall_usecs) {
+    if (stall_usecs == 0) {
+        return NULL;
+    }
+    aegis_rearm();
+    return aegis_heartbeat_register_slot((uint64_t)stall_usecs * 1000ULL, 0);
+}
+
+void aegis_heartbeat_unregister(struct aegis_heartbeat *heartbeat) {
+    size_t s;
+
+    if (heartbeat == NULL) {
+        return;
+    }
+
+    s = heartbeat - &g_aegis_heartbeat.beats[0];
+
+    pthread_mutex_lock(&g_aegis_heartbeat.mtx);
+    if (s < AEGIS_HEARTBEATS_NR && (g_aegis_heartbeat.slots[s].generation & 1) != 0) {
+        __atomic_store_n(&g_aegis_heartbeat.slots[s].generation, g_aegis_heartbeat.slots[s].generation + 1,
+                         __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_aegis_heartbeat.mtx);
+}
+
+void aegis_heartbeat_beat(struct aegis_heartbeat *heartbeat) {
+    __atomic_store_n(&heartbeat->beats, __atomic_load_n(&heartbeat->beats, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+int aegis_set_heartbeat_monitors(const unsigned int monitors_nr, const unsigned int period_usecs,
+                                 aegis_gorgon_on_debugger_func on_stall, void *on_stall_args) {
+    pthread_t thread;
+    struct aegis_heartbeat *heartbeat;
+    unsigned int m, registered_nr = 0, running_nr = 0;
+    int err = 1;
+
+    if (monitors_nr == 0 || monitors_nr > AEGIS_HEARTBEAT_MONITORS_NR || period_usecs == 0) {
+        return err;
+    }
+
+    pthread_mutex_lock(&g_aegis_heartbeat.ring_mtx);
+
+    if (__atomic_exchange_n(&g_aegis_heartbeat.is_ring_set, 1, __ATOMIC_ACQ_REL)) {
+        pthread_mutex_unlock(&g_aegis_heartbeat.ring_mtx);
+        return err;
+    }
+
+    g_aegis_heartbeat.period_usecs = period_usecs;
+    g_aegis_heartbeat.on_stall = (on_stall != NULL) ? on_stall : aegis_default_on_debugger;
+    g_aegis_heartbeat.on_stall_args = on_stall_args;
+
+    for (m = 0; m < monitors_nr; m++) {
+        heartbeat = aegis_heartbeat_register_slot(((uint64_t)period_usecs + AEGIS_HEARTBEAT_SLACK_USECS) * 1000ULL, 1);
+        if (heartbeat == NULL) {
+            goto aegis_set_heartbeat_monitors_epilogue;
+        }
+        g_aegis_heartbeat.monitor_slots[m] = heartbeat - &g_aegis_heartbeat.beats[0];
+        registered_nr++;
+    }
+
+    for (m = 0; m < monitors_nr; m++) {
+        __atomic_fetch_add(&g_aegis_heartbeat.running_nr, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&thread, NULL, aegis_heartbeat_monitor_routine, (void *)(size_t)m) != 0) {
+            __atomic_fetch_sub(&g_aegis_heartbeat.running_nr, 1, __ATOMIC_RELAXED);
+            goto aegis_set_heartbeat_monitors_epilogue;
+        }
+        pthread_detach(thread);
+        running_nr++;
+    }
+
+    err = 0;
+
+aegis_set_heartbeat_monitors_epilogue:
+
+    for (m = running_nr; m < registered_nr; m++) {
+        aegis_heartbeat_unregister(&g_aegis_heartbeat.beats[g_aegis_heartbeat.monitor_slots[m]]);
+    }
+
+    if (running_nr == 0) {
+        __atomic_store_n(&g_aegis_heartbeat.is_ring_set, 0, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&g_aegis_heartbeat.monitors_nr, running_nr, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&g_aegis_heartbeat.ring_mtx);
+
+    return err;
+}
+
+int aegis_stop_heartbeat_monitors(void) {
+    unsigned int m, monitors_nr;
+
+    if (g_aegis_heartbeat_is_monitor) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&g_aegis_heartbeat.ring_mtx);
+
+    if (!__atomic_load_n(&g_aegis_heartbeat.is_ring_set, __ATOMIC_ACQUIRE)) {
+        goto aegis_stop_heartbeat_monitors_epilogue;
+    }
+
+    // INFO(Rafael): Heartbeats go back to the gorgon before monitors leave, nobody is left unwatched.
+    monitors_nr = __atomic_exchange_n(&g_aegis_heartbeat.monitors_nr, 0, __ATOMIC_ACQ_REL);
+
+    __atomic_store_n(&g_aegis_heartbeat.should_stop, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&g_aegis_heartbeat.mtx);
+    while (__atomic_load_n(&g_aegis_heartbeat.running_nr, __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&g_aegis_heartbeat.stopped_cond, &g_aegis_heartbeat.mtx);
+    }
+    pthread_mutex_unlock(&g_aegis_heartbeat.mtx);
+
+    for (m = 0; m < monitors_nr; m++) {
+        aegis_heartbeat_unregister(&g_aegis_heartbeat.beats[g_aegis_heartbeat.monitor_slots[m]]);
+    }
+
+    __atomic_store_n(&g_aegis_heartbeat.should_stop, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_aegis_heartbeat.is_ring_set, 0, __ATOMIC_RELEASE);
+
+aegis_stop_heartbeat_monitors_epilogue:
+
+    pthread_mutex_unlock(&g_aegis_heartbeat.ring_mtx);
+
+    return 0;
+}
+
+struct aegis_heartbeat *aegis_heartbeat_gorgon_register(void) {
+    return aegis_heartbeat_register_slot(AEGIS_HEARTBEAT_PARKED, 0);
+}
+
+void aegis_heartbeat_gorgon_unregister(struct aegis_heartbeat *heartbeat) {
+    aegis_heartbeat_unregister(heartbeat);
+}
+
+void aegis_heartbeat_gorgon_beat(struct aegis_heartbeat *heartbeat, const unsigned int sleep_usecs,
+                                 const uint64_t work_nsecs) {
+    if (heartbeat == NULL) {
+        return;
+    }
+    aegis_heartbeat_set_stall(heartbeat, (sleep_usecs == AEGIS_GORGON_SLEEP_WHEN_IDLE) ?
+                                AEGIS_HEARTBEAT_PARKED :
+                                ((uint64_t)sleep_usecs + AEGIS_HEARTBEAT_SLACK_USECS) * 1000ULL + 2 * work_nsecs);
+}
+
+void aegis_heartbeat_park(struct aegis_heartbeat *heartbeat) {
+    if (heartbeat != NULL) {
+        __atomic_store_n(&g_aegis_heartbeat.slots[heartbeat - &g_aegis_heartbeat.beats[0]].stall_nsecs,
+                         AEGIS_HEARTBEAT_PARKED, __ATOMIC_RELEASE);
+    }
+}
+
+int aegis_heartbeat_gorgon_has_stalls(struct aegis_heartbeat_watcher *watcher) {
+    unsigned int monitors_nr = __atomic_load_n(&g_aegis_heartbeat.monitors_nr, __ATOMIC_ACQUIRE);
+    uint64_t now = aegis_secrets_now();
+    size_t s;
+    int has = 0;
+
+    if (monitors_nr > 0) {
+        s = g_aegis_heartbeat.monitor_slots[0];
+        return aegis_heartbeat_is_stalled(s, &watcher->watches[s], now);
+    }
+
+    for (s = 0; s < AEGIS_HEARTBEATS_NR; s++) {
+        has |= aegis_heartbeat_is_stalled(s, &watcher->watches[s], now);
+    }
+
+    return has;
+}
+
+void aegis_heartbeat_atfork_prepare(void) {
+    pthread_mutex_lock(&g_aegis_heartbeat.mtx);
+}
+
+void aegis_heartbeat_atfork_parent(void) {
+    pthread_mutex_unlock(&g_aegis_heartbeat.mtx);
+}
+
+void aegis_heartbeat_atfork_child(void) {
+    static const pthread_mutex_t ring_mtx = PTHREAD_MUTEX_INITIALIZER;
+    static const pthread_cond_t stopped_cond = PTHREAD_COND_INITIALIZER;
+    pthread_t self = pthread_self();
+    size_t s;
+
+    for (s = 0; s < AEGIS_HEARTBEATS_NR; s++) {
+        if ((g_aegis_heartbeat.slots[s].generation & 1) != 0 &&
+            (g_aegis_heartbeat.slots[s].is_monitor || !pthread_equal(g_aegis_heartbeat.slots[s].owner, self))) {
+            g_aegis_heartbeat.slots[s].generation++;
+        }
+    }
+
+    g_aegis_heartbeat.rearm_monitors_nr = g_aegis_heartbeat.monitors_nr;
+    g_aegis_heartbeat.monitors_nr = 0;
+    g_aegis_heartbeat.running_nr = 0;
+    g_aegis_heartbeat.should_stop = 0;
+    g_aegis_heartbeat.is_ring_set = 0;
+    // INFO(Rafael): It is not taken when forking, a stop could be waiting for monitors that are forking.
+    //               Whoever held it is not in the child anyway.
+    g_aegis_heartbeat.ring_mtx = ring_mtx;
+    g_aegis_heartbeat.stopped_cond = stopped_cond;
+
+    pthread_mutex_unlock(&g_aegis_heartbeat.mtx);
+}
+
+void aegis_heartbeat_rearm(void) {
+    unsigned int monitors_nr = __atomic_exchange_n(&g_aegis_heartbeat.rearm_monitors_nr, 0, __ATOMIC_ACQ_REL);
+    if (monitors_nr > 0) {
+        aegis_set_heartbeat_monitors(monitors_nr, g_aegis_heartbeat.period_usecs,
+                                     g_aegis_heartbeat.on_stall, g_aegis_heartbeat.on_stall_args);
+    }
+}
+
+static struct aegis_heartbeat *aegis_heartbeat_register_slot(const uint64_t stall_nsecs, const int is_monitor) {
+    struct aegis_heartbeat *heartbeat = NULL;
+    size_t s;
+
+    aegis_gorgon_atfork_init();
+
+    pthread_mutex_lock(&g_aegis_heartbeat.mtx);
+
+    for (s = 0; s < AEGIS_HEARTBEATS_NR && (g_aegis_heartbeat.slots[s].generation & 1) != 0; s++)
+        ;
+
+    if (s < AEGIS_HEARTBEATS_NR) {
+        __atomic_store_n(&g_aegis_heartbeat.slots[s].is_monitor, is_monitor, __ATOMIC_RELAXED);
+        g_aegis_heartbeat.slots[s].owner = pthread_self();
+        __atomic_store_n(&g_aegis_heartbeat.slots[s].stall_nsecs, stall_nsecs, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_aegis_heartbeat.slots[s].generation, g_aegis_heartbeat.slots[s].generation + 1,
+                         __ATOMIC_RELEASE);
+        heartbeat = &g_aegis_heartbeat.beats[s];
+    }
+
+    pthread_mutex_unlock(&g_aegis_heartbeat.mtx);
+
+    return heartbeat;
+}
+
+static int aegis_heartbeat_is_stalled(const size_t s, struct aegis_heartbeat_watch *watch, const uint64_t now) {
+    uint32_t generation = __atomic_load_n(&g_aegis_heartbeat.slots[s].generation, __ATOMIC_ACQUIRE);
+    unsigned long long beats;
+    uint64_t stall_nsecs;
+
+    if ((generation & 1) == 0) {
+        return 0;
+    }
+
+    // INFO(Rafael): Stall first, it pairs with aegis_heartbeat_set_stall(). A thread leaving its parking
+    //               has always beaten by the time we see it unparked.
+    stall_nsecs = __atomic_load_n(&g_aegis_heartbeat.slots[s].stall_nsecs, __ATOMIC_ACQUIRE);
+    beats = __atomic_load_n(&g_aegis_heartbeat.beats[s].beats, __ATOMIC_RELAXED);
+
+    if (generation != watch->generation || beats != watch->beats) {
+        watch->generation = generation;
+        watch->beats = beats;
+        watch->changed_at = now;
+        watch->is_flagged = 0;
+        return 0;
+    }
+
+    // INFO(Rafael): Only stalls seen between two of our own samples count, so a watcher that was
+    //               descheduled for a while does not blame threads that kept beating meanwhile.
+    //               A stall is reported once, it is re-armed when the thread beats again.
+    if (!watch->is_flagged && stall_nsecs != AEGIS_HEARTBEAT_PARKED && (now - watch->changed_at) > stall_nsecs) {
+        watch->is_flagged = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void aegis_heartbeat_set_stall(struct aegis_heartbeat *heartbeat, const uint64_t stall_nsecs) {
+    aegis_heartbeat_beat(heartbeat);
+    __atomic_store_n(&g_aegis_heartbeat.slots[heartbeat - &g_aegis_heartbeat.beats[0]].stall_nsecs, stall_nsecs,
+                     __ATOMIC_RELEASE);
+}
+
+static void *aegis_heartbeat_monitor_routine(void *args) {
+    const unsigned int m = (unsigned int)(size_t)args;
+    struct aegis_heartbeat *heartbeat = &g_aegis_heartbeat.beats[g_aegis_heartbeat.monitor_slots[m]];
+    const uint64_t stall_nsecs = ((uint64_t)g_aegis_heartbeat.period_usecs + AEGIS_HEARTBEAT_SLACK_USECS) * 1000ULL;
+    struct aegis_heartbeat_watcher watcher;
+    unsigned int monitors_nr;
+    uint64_t now;
+    size_t s;
+    int has;
+
+    memset(&watcher, 0, sizeof(watcher));
+
+    g_aegis_heartbeat_is_monitor = 1;
+
+    while (!__atomic_load_n(&g_aegis_heartbeat.should_stop, __ATOMIC_ACQUIRE)) {
+        aegis_heartbeat_set_stall(heartbeat, stall_nsecs);
+
+        monitors_nr = __atomic_load_n(&g_aegis_heartbeat.monitors_nr, __ATOMIC_ACQUIRE);
+        if (monitors_nr == 0 || m >= monitors_nr) {
+            usleep(g_aegis_heartbeat.period_usecs);
+            continue;
+        }
+
+        now = aegis_secrets_now();
+        has = 0;
+
+        for (s = m; s < AEGIS_HEARTBEATS_NR; s += monitors_nr) {
+            if (!__atomic_load_n(&g_aegis_heartbeat.slots[s].is_monitor, __ATOMIC_RELAXED)) {
+                has |= aegis_heartbeat_is_stalled(s, &watcher.watches[s], now);
+            }
+        }
+
+        if (monitors_nr > 1) {
+            s = g_aegis_heartbeat.monitor_slots[(m + 1) % monitors_nr];
+            has |= aegis_heartbeat_is_stalled(s, &watcher.watches[s], now);
+        }
+
+        if (has) {
+            // INFO(Rafael): A synchronous on_stall takes its time. Meanwhile our neighbour must not take us as
+            //               stalled, otherwise a single stall would go around the whole ring.
+            aegis_heartbeat_park(heartbeat);
+            aegis_gorgon_handle_detection(AEGIS_RESPONDER_SOURCE_HEARTBEAT,
+                                          g_aegis_heartbeat.on_stall, g_aegis_heartbeat.on_stall_args, now);
+            aegis_heartbeat_set_stall(heartbeat, stall_nsecs);
+        }
+
+        usleep(g_aegis_heartbeat.period_usecs);
+    }
+
+    aegis_heartbeat_park(heartbeat);
+    pthread_mutex_lock(&g_aegis_heartbeat.mtx);
+    if (__atomic_sub_fetch(&g_aegis_heartbeat.running_nr, 1, __ATOMIC_RELEASE) == 0) {
+        pthread_cond_broadcast(&g_aegis_heartbeat.stopped_cond);
+    }
+    pthread_mutex_unlock(&g_aegis_heartbeat.mtx);
+
+    return NULL;
+}
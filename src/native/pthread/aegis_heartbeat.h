@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#ifndef AEGIS_NATIVE_PTHREAD_AEGIS_HEARTBEAT_H
+#define AEGIS_NATIVE_PTHREAD_AEGIS_HEARTBEAT_H 1
+
+#include <stdint.h>
+
+#define AEGIS_HEARTBEATS_NR 256
+
+struct aegis_heartbeat;
+
+struct aegis_heartbeat_watch {
+    uint32_t generation;
+    unsigned long long beats;
+    uint64_t changed_at;
+    int is_flagged;
+};
+
+struct aegis_heartbeat_watcher {
+    struct aegis_heartbeat_watch watches[AEGIS_HEARTBEATS_NR];
+};
+
+struct aegis_heartbeat *aegis_heartbeat_gorgon_register(void);
+
+void aegis_heartbeat_gorgon_unregister(struct aegis_heartbeat *heartbeat);
+
+void aegis_heartbeat_gorgon_beat(struct aegis_heartbeat *heartbeat, const unsigned int sleep_usecs,
+                                 const uint64_t work_nsecs);
+
+// INFO(Rafael): Nobody takes a parked thread as stalled. It is unparked by its next beat.
+void aegis_heartbeat_park(struct aegis_heartbeat *heartbeat);
+
+int aegis_heartbeat_gorgon_has_stalls(struct aegis_heartbeat_watcher *watcher);
+
+void aegis_heartbeat_atfork_prepare(void);
+
+void aegis_heartbeat_atfork_parent(void);
+
+void aegis_heartbeat_atfork_child(void);
+
+void aegis_heartbeat_rearm(void);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <aegis.h>
+#include <native/pthread/aegis_responder.h>
+#include <native/pthread/aegis_gorgon.h>
+#include <native/pthread/aegis_secrets.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+
+// INFO(Rafael): Must be a power of two.
+#define AEGIS_RESPONDER_QUEUE_SIZE 64
+
+#define AEGIS_RESPONDER_DEFAULT_STACK_SIZE (256 * 1024)
+
+struct aegis_responder_cell {
+    uint64_t seqno;
+    int source;
+    aegis_gorgon_on_debugger_func on_debugger;
+    void *on_debugger_args;
+    uint64_t detected_at;
+} __attribute__((aligned(64)));
+
+struct aegis_responder_ctx {
+    struct aegis_responder_cell cells[AEGIS_RESPONDER_QUEUE_SIZE];
+    uint64_t enqueue_at __attribute__((aligned(64)));
+    uint64_t dequeue_at __attribute__((aligned(64)));
+    int in_flight[AEGIS_RESPONDER_SOURCES_NR];
+    int mode;
+    int is_running;
+    int should_respawn;
+    int rearm_mode;
+    void *stack;
+    size_t stack_size;
+    struct aegis_dispatch_stats stats;
+};
+
+static struct aegis_responder_ctx g_aegis_responder = { { { 0 } }, 0, 0, { 0 }, AEGIS_DISPATCH_SYNC, 0, 0, 0, NULL, 0,
+                                                        { 0, 0, 0, 0, 0, 0 } };
+
+static pthread_mutex_t g_aegis_responder_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static sem_t g_aegis_responder_pending;
+
+static int aegis_responder_spawn(void);
+
+static void *aegis_responder_routine(void *args);
+
+static void aegis_responder_reset_queue(void);
+
+static int aegis_responder_enqueue(const int source, aegis_gorgon_on_debugger_func on_debugger,
+                                   void *on_debugger_args, const uint64_t detected_at);
+
+static int aegis_responder_dequeue(struct aegis_responder_cell *item);
+
+static void aegis_responder_account(const uint64_t latency);
+
+int aegis_set_gorgon_dispatch(const int mode, const size_t responder_stack_size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t stack_size = (responder_stack_size != 0) ? responder_stack_size : AEGIS_RESPONDER_DEFAULT_STACK_SIZE;
+    int err = 1;
+
+    if (mode != AEGIS_DISPATCH_SYNC && mode != AEGIS_DISPATCH_ASYNC) {
+        return err;
+    }
+
+    aegis_rearm();
+
+    pthread_mutex_lock(&g_aegis_responder_mtx);
+
+    if (mode == AEGIS_DISPATCH_SYNC || g_aegis_responder.is_running) {
+        __atomic_store_n(&g_aegis_responder.mode, mode, __ATOMIC_RELEASE);
+        err = 0;
+        goto aegis_set_gorgon_dispatch_epilogue;
+    }
+
+    if (stack_size < PTHREAD_STACK_MIN) {
+        goto aegis_set_gorgon_dispatch_epilogue;
+    }
+
+    stack_size = ((stack_size + page_size - 1) / page_size) * page_size;
+    g_aegis_responder.stack = mmap(NULL, stack_size + page_size, PROT_READ | PROT_WRITE,
+#if defined(MAP_STACK)
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+#else
+                                   MAP_PRIVATE | MAP_ANONYMOUS,
+#endif
+                                   -1, 0);
+    if (g_aegis_responder.stack == MAP_FAILED) {
+        g_aegis_responder.stack = NULL;
+        goto aegis_set_gorgon_dispatch_epilogue;
+    }
+
+    mprotect(g_aegis_responder.stack, page_size, PROT_NONE);
+
+    memset((unsigned char *)g_aegis_responder.stack + page_size, 0, stack_size);
+
+    g_aegis_responder.stack_size = stack_size;
+
+    aegis_gorgon_atfork_init();
+
+    aegis_responder_reset_queue();
+
+    if (sem_init(&g_aegis_responder_pending, 0, 0) != 0 || aegis_responder_spawn() != 0) {
+        munmap(g_aegis_responder.stack, stack_size + page_size);
+        g_aegis_responder.stack = NULL;
+        g_aegis_responder.stack_size = 0;
+        goto aegis_set_gorgon_dispatch_epilogue;
+    }
+
+    __atomic_store_n(&g_aegis_responder.mode, mode, __ATOMIC_RELEASE);
+
+    err = 0;
+
+aegis_set_gorgon_dispatch_epilogue:
+
+    pthread_mutex_unlock(&g_aegis_responder_mtx);
+
+    return err;
+}
+
+void aegis_get_dispatch_stats(struct aegis_dispatch_stats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->last_nsecs = __atomic_load_n(&g_aegis_responder.stats.last_nsecs, __ATOMIC_RELAXED);
+    stats->max_nsecs = __atomic_load_n(&g_aegis_responder.stats.max_nsecs, __ATOMIC_RELAXED);
+    stats->total_nsecs = __atomic_load_n(&g_aegis_responder.stats.total_nsecs, __ATOMIC_RELAXED);
+    stats->dispatches_nr = __atomic_load_n(&g_aegis_responder.stats.dispatches_nr, __ATOMIC_RELAXED);
+    stats->coalesced_nr = __atomic_load_n(&g_aegis_responder.stats.coalesced_nr, __ATOMIC_RELAXED);
+    stats->dropped_nr = __atomic_load_n(&g_aegis_responder.stats.dropped_nr, __ATOMIC_RELAXED);
+}
+
+void aegis_responder_dispatch(const int source, aegis_gorgon_on_debugger_func on_debugger, void *on_debugger_args,
+                              const uint64_t detected_at) {
+    int in_flight = 0;
+
+    // INFO(Rafael): Checked in both modes, the dispatching mode can change while the responder is still running
+    //               a callback of this source.
+    if (!__atomic_compare_exchange_n(&g_aegis_responder.in_flight[source], &in_flight, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&g_aegis_responder.stats.coalesced_nr, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (__atomic_load_n(&g_aegis_responder.mode, __ATOMIC_ACQUIRE) == AEGIS_DISPATCH_ASYNC) {
+        if (aegis_responder_enqueue(source, on_debugger, on_debugger_args, detected_at) == 0) {
+            sem_post(&g_aegis_responder_pending);
+            return;
+        }
+        __atomic_add_fetch(&g_aegis_responder.stats.dropped_nr, 1, __ATOMIC_RELAXED);
+    } else {
+        aegis_responder_account(aegis_secrets_now() - detected_at);
+        on_debugger(on_debugger_args);
+    }
+
+    __atomic_store_n(&g_aegis_responder.in_flight[source], 0, __ATOMIC_RELEASE);
+}
+
+void aegis_responder_atfork_prepare(void) {
+    pthread_mutex_lock(&g_aegis_responder_mtx);
+}
+
+void aegis_responder_atfork_parent(void) {
+    pthread_mutex_unlock(&g_aegis_responder_mtx);
+}
+
+void aegis_responder_atfork_child(void) {
+    memset(&g_aegis_responder.stats, 0, sizeof(g_aegis_responder.stats));
+    memset(g_aegis_responder.in_flight, 0, sizeof(g_aegis_responder.in_flight));
+    g_aegis_responder.should_respawn = g_aegis_responder.is_running;
+    g_aegis_responder.rearm_mode = g_aegis_responder.mode;
+    g_aegis_responder.is_running = 0;
+    g_aegis_responder.mode = AEGIS_DISPATCH_SYNC;
+    pthread_mutex_unlock(&g_aegis_responder_mtx);
+}
+
+void aegis_responder_rearm(void) {
+    pthread_mutex_lock(&g_aegis_responder_mtx);
+    if (g_aegis_responder.should_respawn) {
+        g_aegis_responder.should_respawn = 0;
+        aegis_responder_reset_queue();
+        if (sem_init(&g_aegis_responder_pending, 0, 0) == 0 && aegis_responder_spawn() == 0) {
+            __atomic_store_n(&g_aegis_responder.mode, g_aegis_responder.rearm_mode, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&g_aegis_responder_mtx);
+}
+
+static int aegis_responder_spawn(void) {
+    pthread_attr_t attr;
+    pthread_t responder;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    int err = 1;
+
+    if (pthread_attr_init(&attr) != 0) {
+        return err;
+    }
+
+    if (pthread_attr_setstack(&attr, (unsigned char *)g_aegis_responder.stack + page_size,
+                              g_aegis_responder.stack_size) == 0 &&
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
+        pthread_create(&responder, &attr, aegis_responder_routine, &g_aegis_responder) == 0) {
+        g_aegis_responder.is_running = 1;
+        err = 0;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return err;
+}
+
+static void *aegis_responder_routine(void *args) {
+    struct aegis_responder_ctx *responder = (struct aegis_responder_ctx *)args;
+    struct aegis_responder_cell item;
+
+    for (;;) {
+        if (sem_wait(&g_aegis_responder_pending) != 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        while (aegis_responder_dequeue(&item) == 0) {
+            aegis_responder_account(aegis_secrets_now() - item.detected_at);
+            item.on_debugger(item.on_debugger_args);
+            __atomic_store_n(&responder->in_flight[item.source], 0, __ATOMIC_RELEASE);
+        }
+    }
+
+    return NULL;
+}
+
+static void aegis_responder_reset_queue(void) {
+    size_t c;
+    for (c = 0; c < AEGIS_RESPONDER_QUEUE_SIZE; c++) {
+        g_aegis_responder.cells[c].seqno = c;
+    }
+    g_aegis_responder.enqueue_at = 0;
+    g_aegis_responder.dequeue_at = 0;
+}
+
+// INFO(Rafael): Dmitry Vyukov's bounded queue. Each cell carries a sequence number telling whether it is free
+//               for the producer at position 'seqno' or filled for the consumer at 'seqno - 1'. Producers
+//               (the gorgon and heartbeat monitors) only race on enqueue_at, the responder alone consumes.
+
+static int aegis_responder_enqueue(const int source, aegis_gorgon_on_debugger_func on_debugger,
+                                   void *on_debugger_args, const uint64_t detected_at) {
+    struct aegis_responder_cell *cell;
+    uint64_t pos = __atomic_load_n(&g_aegis_responder.enqueue_at, __ATOMIC_RELAXED);
+    uint64_t seqno;
+    int64_t diff;
+
+    for (;;) {
+        cell = &g_aegis_responder.cells[pos & (AEGIS_RESPONDER_QUEUE_SIZE - 1)];
+        seqno = __atomic_load_n(&cell->seqno, __ATOMIC_ACQUIRE);
+        diff = (int64_t)seqno - (int64_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_aegis_responder.enqueue_at, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 1;
+        } else {
+            pos = __atomic_load_n(&g_aegis_responder.enqueue_at, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->source = source;
+    cell->on_debugger = on_debugger;
+    cell->on_debugger_args = on_debugger_args;
+    cell->detected_at = detected_at;
+    __atomic_store_n(&cell->seqno, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static int aegis_responder_dequeue(struct aegis_responder_cell *item) {
+    uint64_t pos = g_aegis_responder.dequeue_at;
+    struct aegis_responder_cell *cell = &g_aegis_responder.cells[pos & (AEGIS_RESPONDER_QUEUE_SIZE - 1)];
+
+    if (__atomic_load_n(&cell->seqno, __ATOMIC_ACQUIRE) != pos + 1) {
+        return 1;
+    }
+
+    item->source = cell->source;
+    item->on_debugger = cell->on_debugger;
+    item->on_debugger_args = cell->on_debugger_args;
+    item->detected_at = cell->detected_at;
+    g_aegis_responder.dequeue_at = pos + 1;
+    __atomic_store_n(&cell->seqno, pos + AEGIS_RESPONDER_QUEUE_SIZE, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void aegis_responder_account(const uint64_t latency) {
+    uint64_t max = __atomic_load_n(&g_aegis_responder.stats.max_nsecs, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_aegis_responder.stats.last_nsecs, latency, __ATOMIC_RELAXED);
+    while (latency > max && !__atomic_compare_exchange_n(&g_aegis_responder.stats.max_nsecs, &max, latency, 1,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&g_aegis_responder.stats.total_nsecs, latency, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_aegis_responder.stats.dispatches_nr, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#ifndef AEGIS_NATIVE_PTHREAD_AEGIS_RESPONDER_H
+#define AEGIS_NATIVE_PTHREAD_AEGIS_RESPONDER_H 1
+
+#include <aegis.h>
+#include <stdint.h>
+
+#define AEGIS_RESPONDER_SOURCE_GORGON    0
+#define AEGIS_RESPONDER_SOURCE_HEARTBEAT 1
+#define AEGIS_RESPONDER_SOURCES_NR       2
+
+// INFO(Rafael): Runs on_debugger right here or hands it to the responder thread, depending on the dispatch mode.
+//               A source never has more than one callback queued or running.
+void aegis_responder_dispatch(const int source, aegis_gorgon_on_debugger_func on_debugger, void *on_debugger_args,
+                              const uint64_t detected_at);
+
+void aegis_responder_atfork_prepare(void);
+
+void aegis_responder_atfork_parent(void);
+
+void aegis_responder_atfork_child(void);
+
+void aegis_responder_rearm(void);
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <aegis.h>
+#include <native/pthread/aegis_secrets.h>
+#include <native/pthread/aegis_gorgon.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define AEGIS_SECRETS_NR 1024
+
+#define AEGIS_WIPE_CHUNK_SIZE (4 << 20)
+
+#define AEGIS_WIPE_WORKERS_NR 64
+
+#define AEGIS_WIPE_STALL_NSECS 100000000ULL
+
+#define AEGIS_WIPE_JOBS_NR 2
+
+#define AEGIS_WIPE_UNREGISTER_POLL_NSECS 100000L
+
+#define AEGIS_WIPE_CURSOR(seqno, chunk) (((uint64_t)(seqno) << 32) | (uint64_t)(chunk))
+
+#define AEGIS_WIPE_CURSOR_SEQNO(cursor) ((uint32_t)((cursor) >> 32))
+
+#define AEGIS_WIPE_CURSOR_CHUNK(cursor) ((size_t)((cursor) & 0xFFFFFFFF))
+
+#define AEGIS_WIPE_CURSOR_CLOSED 0xFFFFFFFF
+
+struct aegis_secret {
+    unsigned char *data;
+    size_t data_size;
+};
+
+struct aegis_wipe_job {
+    struct aegis_secret secrets[AEGIS_SECRETS_NR];
+    size_t first_chunk[AEGIS_SECRETS_NR + 1];
+    size_t secrets_nr;
+    size_t chunks_nr;
+    uint64_t cursor;
+    size_t done_chunks;
+    size_t wiped_bytes;
+    unsigned int running_nr;
+};
+
+struct aegis_secrets_ctx {
+    struct aegis_secret secrets[AEGIS_SECRETS_NR];
+    pthread_mutex_t registry_mtx;
+    pthread_mutex_t wipe_mtx;
+    pthread_mutex_t workers_mtx;
+    pthread_cond_t workers_cond;
+    pthread_t workers[AEGIS_WIPE_WORKERS_NR];
+    unsigned int workers_nr;
+    unsigned int rearm_workers_nr;
+    uint32_t job_seqno;
+    unsigned int job_slot;
+    struct aegis_wipe_job jobs[AEGIS_WIPE_JOBS_NR];
+    struct aegis_wipe_stats stats;
+};
+
+static struct aegis_secrets_ctx g_aegis_secrets = { { { NULL, 0 } },
+                                                    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+                                                    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void aegis_secure_zero(void *data, const size_t data_size);
+
+static void aegis_wipe_job_run(struct aegis_wipe_job *job, const uint32_t seqno);
+
+static void aegis_wipe_job_run_serially(const struct aegis_wipe_job *job);
+
+static size_t aegis_wipe_registry_serially(void);
+
+static int aegis_wipe_jobs_hold(const void *data);
+
+static void *aegis_wipe_worker_routine(void *args);
+
+int aegis_register_secret(void *data, const size_t data_size) {
+    size_t s;
+    int err = 1;
+
+    if (data == NULL || data_size == 0) {
+        return err;
+    }
+
+    aegis_gorgon_atfork_init();
+    aegis_rearm();
+
+    pthread_mutex_lock(&g_aegis_secrets.registry_mtx);
+
+    for (s = 0; s < AEGIS_SECRETS_NR && g_aegis_secrets.secrets[s].data != NULL; s++)
+        ;
+
+    if (s < AEGIS_SECRETS_NR) {
+        // INFO(Rafael): Size goes first, a concurrent wipe only trusts slots with data != NULL.
+        __atomic_store_n(&g_aegis_secrets.secrets[s].data_size, data_size, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_aegis_secrets.secrets[s].data, (unsigned char *)data, __ATOMIC_RELEASE);
+        err = 0;
+    }
+
+    pthread_mutex_unlock(&g_aegis_secrets.registry_mtx);
+
+    return err;
+}
+
+int aegis_unregister_secret(void *data) {
+    struct timespec poll_interval = { 0, AEGIS_WIPE_UNREGISTER_POLL_NSECS };
+    size_t s, data_size = 0;
+    uint64_t stall_deadline;
+    int err = 1, is_held;
+
+    pthread_mutex_lock(&g_aegis_secrets.registry_mtx);
+
+    for (s = 0; s < AEGIS_SECRETS_NR && err != 0; s++) {
+        if (g_aegis_secrets.secrets[s].data == data) {
+            data_size = g_aegis_secrets.secrets[s].data_size;
+            __atomic_store_n(&g_aegis_secrets.secrets[s].data, NULL, __ATOMIC_RELEASE);
+            err = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&g_aegis_secrets.registry_mtx);
+
+    if (err != 0) {
+        return err;
+    }
+
+    // INFO(Rafael): A wipe in flight may have taken it before we dropped it. A worker stuck on it beyond the
+    //               stall limit keeps it registered, the caller must not release it.
+    stall_deadline = aegis_secrets_now() + AEGIS_WIPE_STALL_NSECS;
+    for (;;) {
+        pthread_mutex_lock(&g_aegis_secrets.wipe_mtx);
+        is_held = aegis_wipe_jobs_hold(data);
+        pthread_mutex_unlock(&g_aegis_secrets.wipe_mtx);
+        if (!is_held) {
+            break;
+        }
+        if (aegis_secrets_now() > stall_deadline) {
+            aegis_register_secret(data, data_size);
+            err = 1;
+            break;
+        }
+        nanosleep(&poll_interval, NULL);
+    }
+
+    return err;
+}
+
+int aegis_set_wipe_workers(const unsigned int workers_nr) {
+    int err = 0;
+
+    if (workers_nr > AEGIS_WIPE_WORKERS_NR) {
+        return 1;
+    }
+
+    aegis_gorgon_atfork_init();
+
+    pthread_mutex_lock(&g_aegis_secrets.workers_mtx);
+    while (err == 0 && g_aegis_secrets.workers_nr < workers_nr) {
+        err = pthread_create(&g_aegis_secrets.workers[g_aegis_secrets.workers_nr], NULL,
+                             aegis_wipe_worker_routine, NULL);
+        if (err == 0) {
+            pthread_detach(g_aegis_secrets.workers[g_aegis_secrets.workers_nr]);
+            g_aegis_secrets.workers_nr++;
+        }
+    }
+    pthread_mutex_unlock(&g_aegis_secrets.workers_mtx);
+
+    return err;
+}
+
+void aegis_wipe_secrets(void) {
+    aegis_rearm();
+    aegis_secrets_wipe_on_detection(aegis_secrets_now());
+}
+
+void aegis_get_wipe_stats(struct aegis_wipe_stats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&g_aegis_secrets.wipe_mtx);
+    *stats = g_aegis_secrets.stats;
+    pthread_mutex_unlock(&g_aegis_secrets.wipe_mtx);
+}
+
+uint64_t aegis_secrets_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+void aegis_secrets_wipe_on_detection(const uint64_t detected_at) {
+    struct aegis_wipe_job *job;
+    unsigned char *data;
+    size_t s;
+    size_t wiped_bytes;
+    unsigned int slot;
+    uint32_t seqno;
+    uint64_t elapsed, stall_deadline;
+
+    pthread_mutex_lock(&g_aegis_secrets.wipe_mtx);
+
+    // INFO(Rafael): Workers only join the published job, so nobody can come into the other one. Once the
+    //               late ones (if any) have left it, it is ours to rebuild.
+    slot = (g_aegis_secrets.job_slot + 1) % AEGIS_WIPE_JOBS_NR;
+    job = &g_aegis_secrets.jobs[slot];
+
+    if (__atomic_load_n(&job->running_nr, __ATOMIC_ACQUIRE) > 0) {
+        wiped_bytes = aegis_wipe_registry_serially();
+        goto aegis_secrets_wipe_on_detection_epilogue;
+    }
+
+    seqno = __atomic_load_n(&g_aegis_secrets.job_seqno, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&job->cursor, AEGIS_WIPE_CURSOR(seqno, AEGIS_WIPE_CURSOR_CLOSED), __ATOMIC_RELEASE);
+
+    job->secrets_nr = 0;
+    job->chunks_nr = 0;
+    job->wiped_bytes = 0;
+    for (s = 0; s < AEGIS_SECRETS_NR; s++) {
+        if ((data = __atomic_load_n(&g_aegis_secrets.secrets[s].data, __ATOMIC_ACQUIRE)) != NULL) {
+            job->secrets[job->secrets_nr].data = data;
+            job->secrets[job->secrets_nr].data_size = g_aegis_secrets.secrets[s].data_size;
+            job->first_chunk[job->secrets_nr] = job->chunks_nr;
+            job->chunks_nr += (job->secrets[job->secrets_nr].data_size + AEGIS_WIPE_CHUNK_SIZE - 1) /
+                              AEGIS_WIPE_CHUNK_SIZE;
+            job->wiped_bytes += job->secrets[job->secrets_nr].data_size;
+            job->secrets_nr++;
+        }
+    }
+    job->first_chunk[job->secrets_nr] = job->chunks_nr;
+    __atomic_store_n(&job->done_chunks, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&job->cursor, AEGIS_WIPE_CURSOR(seqno, 0), __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&g_aegis_secrets.workers_mtx);
+    g_aegis_secrets.job_slot = slot;
+    __atomic_store_n(&g_aegis_secrets.job_seqno, seqno, __ATOMIC_RELAXED);
+    if (job->chunks_nr > 1 && g_aegis_secrets.workers_nr > 0) {
+        pthread_cond_broadcast(&g_aegis_secrets.workers_cond);
+    }
+    pthread_mutex_unlock(&g_aegis_secrets.workers_mtx);
+
+    aegis_wipe_job_run(job, seqno);
+
+    stall_deadline = aegis_secrets_now() + AEGIS_WIPE_STALL_NSECS;
+    while (__atomic_load_n(&job->done_chunks, __ATOMIC_ACQUIRE) < job->chunks_nr) {
+        if (aegis_secrets_now() > stall_deadline) {
+            aegis_wipe_job_run_serially(job);
+            break;
+        }
+        sched_yield();
+    }
+
+    wiped_bytes = job->wiped_bytes;
+
+aegis_secrets_wipe_on_detection_epilogue:
+
+    elapsed = aegis_secrets_now() - detected_at;
+    g_aegis_secrets.stats.last_nsecs = elapsed;
+    if (elapsed > g_aegis_secrets.stats.max_nsecs) {
+        g_aegis_secrets.stats.max_nsecs = elapsed;
+    }
+    g_aegis_secrets.stats.wiped_bytes = wiped_bytes;
+    g_aegis_secrets.stats.wipes_nr++;
+
+    pthread_mutex_unlock(&g_aegis_secrets.wipe_mtx);
+}
+
+void aegis_secrets_atfork_prepare(void) {
+    pthread_mutex_lock(&g_aegis_secrets.wipe_mtx);
+    pthread_mutex_lock(&g_aegis_secrets.workers_mtx);
+    pthread_mutex_lock(&g_aegis_secrets.registry_mtx);
+}
+
+void aegis_secrets_atfork_parent(void) {
+    pthread_mutex_unlock(&g_aegis_secrets.registry_mtx);
+    pthread_mutex_unlock(&g_aegis_secrets.workers_mtx);
+    pthread_mutex_unlock(&g_aegis_secrets.wipe_mtx);
+}
+
+void aegis_secrets_atfork_child(void) {
+    static const pthread_cond_t workers_cond = PTHREAD_COND_INITIALIZER;
+    size_t j;
+
+    pthread_mutex_unlock(&g_aegis_secrets.registry_mtx);
+    pthread_mutex_unlock(&g_aegis_secrets.workers_mtx);
+    pthread_mutex_unlock(&g_aegis_secrets.wipe_mtx);
+
+    g_aegis_secrets.workers_cond = workers_cond;
+    memset(&g_aegis_secrets.stats, 0, sizeof(g_aegis_secrets.stats));
+    for (j = 0; j < AEGIS_WIPE_JOBS_NR; j++) {
+        g_aegis_secrets.jobs[j].running_nr = 0;
+    }
+    g_aegis_secrets.rearm_workers_nr = g_aegis_secrets.workers_nr;
+    g_aegis_secrets.workers_nr = 0;
+}
+
+void aegis_secrets_rearm(void) {
+    unsigned int workers_nr = __atomic_exchange_n(&g_aegis_secrets.rearm_workers_nr, 0, __ATOMIC_ACQ_REL);
+    if (workers_nr > 0) {
+        aegis_set_wipe_workers(workers_nr);
+    }
+}
+
+static void aegis_secure_zero(void *data, const size_t data_size) {
+    // INFO(Rafael): libc's memset is already vectorized, the empty asm statement taking the
+    //               pointer keeps the compiler from eliding it as a dead store.
+    memset(data, 0, data_size);
+    __asm__ __volatile__("" : : "r"(data) : "memory");
+}
+
+static void aegis_wipe_job_run(struct aegis_wipe_job *job, const uint32_t seqno) {
+    uint64_t cursor = __atomic_load_n(&job->cursor, __ATOMIC_ACQUIRE);
+    size_t chunk, s = 0, offset, size;
+    while (AEGIS_WIPE_CURSOR_SEQNO(cursor) == seqno && (chunk = AEGIS_WIPE_CURSOR_CHUNK(cursor)) < job->chunks_nr) {
+        if (!__atomic_compare_exchange_n(&job->cursor, &cursor, cursor + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        while (job->first_chunk[s + 1] <= chunk) {
+            s++;
+        }
+        offset = (chunk - job->first_chunk[s]) * AEGIS_WIPE_CHUNK_SIZE;
+        size = job->secrets[s].data_size - offset;
+        if (size > AEGIS_WIPE_CHUNK_SIZE) {
+            size = AEGIS_WIPE_CHUNK_SIZE;
+        }
+        aegis_secure_zero(job->secrets[s].data + offset, size);
+        __atomic_fetch_add(&job->done_chunks, 1, __ATOMIC_RELEASE);
+        cursor = __atomic_load_n(&job->cursor, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void aegis_wipe_job_run_serially(const struct aegis_wipe_job *job) {
+    size_t s;
+    for (s = 0; s < job->secrets_nr; s++) {
+        aegis_secure_zero(job->secrets[s].data, job->secrets[s].data_size);
+    }
+}
+
+static size_t aegis_wipe_registry_serially(void) {
+    unsigned char *data;
+    size_t s, wiped_bytes = 0;
+    for (s = 0; s < AEGIS_SECRETS_NR; s++) {
+        if ((data = __atomic_load_n(&g_aegis_secrets.secrets[s].data, __ATOMIC_ACQUIRE)) != NULL) {
+            aegis_secure_zero(data, g_aegis_secrets.secrets[s].data_size);
+            wiped_bytes += g_aegis_secrets.secrets[s].data_size;
+        }
+    }
+    return wiped_bytes;
+}
+
+static int aegis_wipe_jobs_hold(const void *data) {
+    const struct aegis_wipe_job *job;
+    size_t j, s;
+    for (j = 0; j < AEGIS_WIPE_JOBS_NR; j++) {
+        job = &g_aegis_secrets.jobs[j];
+        if (__atomic_load_n(&job->running_nr, __ATOMIC_ACQUIRE) == 0) {
+            continue;
+        }
+        for (s = 0; s < job->secrets_nr && job->secrets[s].data != data; s++)
+            ;
+        if (s < job->secrets_nr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *aegis_wipe_worker_routine(void *args) {
+    struct aegis_wipe_job *job;
+    uint32_t seqno;
+    pthread_mutex_lock(&g_aegis_secrets.workers_mtx);
+    seqno = g_aegis_secrets.job_seqno;
+    for (;;) {
+        while (seqno == g_aegis_secrets.job_seqno) {
+            pthread_cond_wait(&g_aegis_secrets.workers_cond, &g_aegis_secrets.workers_mtx);
+        }
+        seqno = g_aegis_secrets.job_seqno;
+        job = &g_aegis_secrets.jobs[g_aegis_secrets.job_slot];
+        __atomic_fetch_add(&job->running_nr, 1, __ATOMIC_ACQ_REL);
+        pthread_mutex_unlock(&g_aegis_secrets.workers_mtx);
+        aegis_wipe_job_run(job, seqno);
+        __atomic_fetch_sub(&job->running_nr, 1, __ATOMIC_ACQ_REL);
+        pthread_mutex_lock(&g_aegis_secrets.workers_mtx);
+    }
+    return NULL;
+}
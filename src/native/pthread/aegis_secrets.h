@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2020, Rafael Santiago
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#ifndef AEGIS_NATIVE_PTHREAD_AEGIS_SECRETS_H
+#define AEGIS_NATIVE_PTHREAD_AEGIS_SECRETS_H 1
+
+#include <stdint.h>
+
+uint64_t aegis_secrets_now(void);
+
+void aegis_secrets_wipe_on_detection(const uint64_t detected_at);
+
+void aegis_secrets_atfork_prepare(void);
+
+void aegis_secrets_atfork_parent(void);
+
+void aegis_secrets_atfork_child(void);
+
+void aegis_secrets_rearm(void);
+
+#endif
@@ -15,6 +15,8 @@
 #include <fltuser.h>
 
 #if !defined(CGO)
+#define AEGIS_GORGON_PARKED_MSECS 100
+
 struct aegis_gorgon_exec_ctx {
     HANDLE thread;
     aegis_gorgon_exit_test_func should_exit;
@@ -23,9 +25,20 @@ struct aegis_gorgon_exec_ctx {
     void *on_debugger_args;
 };
 
+struct aegis_protect_ctx {
+    volatile LONG depth;
+    volatile LONG active_usecs;
+    volatile LONG idle_usecs;
+    HANDLE event;
+};
+
 static struct aegis_gorgon_exec_ctx g_aegis_gorgon = { 0, NULL, NULL, NULL, NULL };
 
+static struct aegis_protect_ctx g_aegis_protect = { 0, 1, 1, NULL };
+
 static DWORD WINAPI aegis_gorgon_routine(LPVOID args);
+
+static DWORD aegis_usecs_to_msecs(const unsigned int usecs);
 #endif // !defined(CGO)
 
 #define AEGIS_WIN_HAS_FLT_USER_CAPS defined(_MSC_VER) || (defined(__GNUC__) && __GNUC__ >= 11)
@@ -130,6 +143,10 @@ int aegis_set_gorgon(aegis_gorgon_exit_test_func exit_test, void *exit_test_args
     g_aegis_gorgon.should_exit_args = exit_test_args;
     g_aegis_gorgon.on_debugger = (on_debugger != NULL) ? on_debugger : aegis_default_on_debugger;
     g_aegis_gorgon.on_debugger_args = on_debugger_args;
+    if (g_aegis_protect.event == NULL) {
+        // INFO(Rafael): Auto-reset event, a region begun before the gorgon starts waiting is not lost.
+        g_aegis_protect.event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    }
     g_aegis_gorgon.thread = CreateThread(NULL, 0, aegis_gorgon_routine, &g_aegis_gorgon, 0, NULL);
     if (g_aegis_gorgon.thread != NULL) {
         err = 0;
@@ -137,6 +154,32 @@ int aegis_set_gorgon(aegis_gorgon_exit_test_func exit_test, void *exit_test_args
     return err;
 }
 
+int aegis_set_gorgon_probe_rate(const unsigned int active_usecs, const unsigned int idle_usecs) {
+    if (active_usecs == 0 || idle_usecs == 0) {
+        return 1;
+    }
+    InterlockedExchange(&g_aegis_protect.active_usecs, (LONG)active_usecs);
+    InterlockedExchange(&g_aegis_protect.idle_usecs, (LONG)idle_usecs);
+    aegis_wake_gorgon();
+    return 0;
+}
+
+void aegis_wake_gorgon(void) {
+    if (g_aegis_protect.event != NULL) {
+        SetEvent(g_aegis_protect.event);
+    }
+}
+
+void aegis_protect_begin(void) {
+    if (InterlockedIncrement(&g_aegis_protect.depth) == 1 && g_aegis_protect.event != NULL) {
+        SetEvent(g_aegis_protect.event);
+    }
+}
+
+void aegis_protect_end(void) {
+    InterlockedDecrement(&g_aegis_protect.depth);
+}
+
 static DWORD WINAPI aegis_gorgon_routine(LPVOID args) {
     int stop = 0;
     struct aegis_gorgon_exec_ctx *exec = (struct aegis_gorgon_exec_ctx *)args;
@@ -144,15 +187,34 @@ static DWORD WINAPI aegis_gorgon_routine(LPVOID args) {
     void *exit_args = exec->should_exit_args;
     aegis_gorgon_on_debugger_func on_debugger = exec->on_debugger;
     void *on_debugger_args = exec->on_debugger_args;
+    unsigned int active_usecs, idle_usecs;
+    int is_active;
     while (!stop) {
-        if (aegis_has_debugger()) {
-            on_debugger(on_debugger_args);
+        active_usecs = (unsigned int)g_aegis_protect.active_usecs;
+        idle_usecs = (unsigned int)g_aegis_protect.idle_usecs;
+        is_active = (g_aegis_protect.depth > 0);
+        if (idle_usecs != AEGIS_GORGON_SLEEP_WHEN_IDLE || is_active) {
+            if (aegis_has_debugger()) {
+                on_debugger(on_debugger_args);
+            }
         }
         if (should_exit != NULL) {
             stop = should_exit(exit_args);
         }
-        Sleep(1);
+        if (!stop) {
+            if (idle_usecs == active_usecs || is_active) {
+                Sleep(aegis_usecs_to_msecs(active_usecs));
+            } else if (idle_usecs == AEGIS_GORGON_SLEEP_WHEN_IDLE) {
+                WaitForSingleObject(g_aegis_protect.event, AEGIS_GORGON_PARKED_MSECS);
+            } else {
+                WaitForSingleObject(g_aegis_protect.event, aegis_usecs_to_msecs(idle_usecs));
+            }
+        }
     }
     return 0;
 }
+
+static DWORD aegis_usecs_to_msecs(const unsigned int usecs) {
+    return (usecs < 1000) ? 1 : (DWORD)(usecs / 1000);
+}
 #endif // !defined(CGO)
@@ -20,9 +20,7 @@ int main(int argc, char **argv) {
     signal(SIGINT, sigint_watchdog);
     signal(SIGTERM, sigint_watchdog);
     printf("*** Waiting for debug attachment (pid=%d)...\n", getpid());
-    while (!aegis_has_debugger()) {
-        usleep(1);
-    }
+    aegis_wait_for_debugger(AEGIS_WAIT_FOREVER);
     printf("*** Debugger is attached.\n");
     return 0;
 }
@@ -6,11 +6,14 @@
  * LICENSE file in the root directory of this source tree.
  */
 #include <cutest.h>
+#include <aegis.h>
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <signal.h>
+#include <time.h>
 #if defined(__FreeBSD__)
 # include <sys/types.h>
 # include <sys/user.h>
@@ -24,9 +27,18 @@
 # include <sys/sysctl.h>
 # include <unistd.h>
 # include <sys/wait.h>
+#elif defined(__linux__)
+# include <sys/wait.h>
+# include <sys/stat.h>
+# include <native/linux/aegis_config.h>
+#elif defined(__OpenBSD__)
+# include <sys/wait.h>
 #elif defined(_WIN32)
 # include <windows.h>
 #endif
+#if !defined(_WIN32)
+# include <pthread.h>
+#endif
 
 #define TEST_SLEEP_IN_SECS 1
 
@@ -60,10 +72,54 @@ CUTE_MAIN(aegis_tests);
 
 CUTE_DECLARE_TEST_CASE(aegis_has_debugger_tests);
 CUTE_DECLARE_TEST_CASE(aegis_set_gorgon_tests);
+CUTE_DECLARE_TEST_CASE(aegis_wait_for_debugger_tests);
+CUTE_DECLARE_TEST_CASE(aegis_protect_tests);
+#if !defined(_WIN32)
+CUTE_DECLARE_TEST_CASE(aegis_wipe_secrets_tests);
+CUTE_DECLARE_TEST_CASE(aegis_unregister_secret_tests);
+CUTE_DECLARE_TEST_CASE(aegis_heartbeat_tests);
+CUTE_DECLARE_TEST_CASE(aegis_atfork_tests);
+CUTE_DECLARE_TEST_CASE(aegis_dispatch_tests);
+#endif
+#if defined(__linux__)
+CUTE_DECLARE_TEST_CASE(aegis_daemon_attach_tests);
+CUTE_DECLARE_TEST_CASE(aegis_daemon_verdict_tests);
+CUTE_DECLARE_TEST_CASE(aegis_selftrap_tests);
+CUTE_DECLARE_TEST_CASE(aegis_selftrap_chaining_tests);
+CUTE_DECLARE_TEST_CASE(aegis_procfs_root_tests);
+CUTE_DECLARE_TEST_CASE(aegis_ancestry_tests);
+CUTE_DECLARE_TEST_CASE(aegis_config_parse_tests);
+CUTE_DECLARE_TEST_CASE(aegis_config_reload_tests);
+#endif
 
 CUTE_TEST_CASE(aegis_tests)
+#if defined(__linux__)
+    // INFO(Rafael): The configuration file is located only once, before the first probe.
+    mkdir("config-test", 0755);
+    setenv(AEGIS_CONFIG_ENV, "config-test/aegis.conf", 1);
+#endif
     CUTE_RUN_TEST(aegis_has_debugger_tests);
     CUTE_RUN_TEST(aegis_set_gorgon_tests);
+    CUTE_RUN_TEST(aegis_wait_for_debugger_tests);
+    CUTE_RUN_TEST(aegis_protect_tests);
+#if !defined(_WIN32)
+    CUTE_RUN_TEST(aegis_wipe_secrets_tests);
+    CUTE_RUN_TEST(aegis_unregister_secret_tests);
+    CUTE_RUN_TEST(aegis_heartbeat_tests);
+    CUTE_RUN_TEST(aegis_atfork_tests);
+    CUTE_RUN_TEST(aegis_dispatch_tests);
+#endif
+#if defined(__linux__)
+    CUTE_RUN_TEST(aegis_daemon_attach_tests);
+    CUTE_RUN_TEST(aegis_daemon_verdict_tests);
+    CUTE_RUN_TEST(aegis_selftrap_tests);
+    CUTE_RUN_TEST(aegis_selftrap_chaining_tests);
+    CUTE_RUN_TEST(aegis_procfs_root_tests);
+    CUTE_RUN_TEST(aegis_ancestry_tests);
+    CUTE_RUN_TEST(aegis_config_parse_tests);
+    CUTE_RUN_TEST(aegis_config_reload_tests);
+    rmdir("config-test");
+#endif
 CUTE_TEST_CASE_END
 
 #if defined(_WIN32)
@@ -277,6 +333,350 @@ CUTE_TEST_CASE(aegis_set_gorgon_tests)
     }
 CUTE_TEST_CASE_END
 
+#if defined(__linux__)
+
+static int g_test_traps_nr = 0;
+
+static void test_on_sigtrap(int signo) {
+    g_test_traps_nr++;
+}
+
+CUTE_TEST_CASE(aegis_selftrap_tests)
+    struct aegis_probe_stats stats;
+    void (*old_handler)(int);
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTICS_ALL + 1) != 0);
+    old_handler = signal(SIGTRAP, test_on_sigtrap);
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTIC_SELFTRAP) == 0);
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTIC_PROCFS) == 0);
+    aegis_get_selftrap_stats(&stats);
+    CUTE_ASSERT(stats.probes_nr > 0);
+    CUTE_ASSERT(stats.last_nsecs <= stats.max_nsecs);
+    CUTE_ASSERT(stats.max_nsecs <= stats.total_nsecs);
+    raise(SIGTRAP);
+    CUTE_ASSERT(g_test_traps_nr == 1);
+    signal(SIGTRAP, old_handler);
+CUTE_TEST_CASE_END
+
+static volatile sig_atomic_t g_test_chained_traps_nr = 0;
+
+static volatile sig_atomic_t g_test_chained_mask_is_wrong = 0;
+
+static int g_test_selftrap_prober_should_exit = 0;
+
+static void test_on_chained_sigtrap(int signo) {
+    sigset_t blocked;
+    pthread_sigmask(SIG_BLOCK, NULL, &blocked);
+    if (!sigismember(&blocked, SIGUSR1) || sigismember(&blocked, SIGTRAP)) {
+        g_test_chained_mask_is_wrong = 1;
+    }
+    g_test_chained_traps_nr++;
+}
+
+static void *test_selftrap_prober(void *args) {
+    while (!__atomic_load_n(&g_test_selftrap_prober_should_exit, __ATOMIC_RELAXED)) {
+        aegis_has_debugger();
+    }
+    return NULL;
+}
+
+static int test_selftrap_chaining(void) {
+    struct sigaction action, current;
+    pthread_t prober;
+    int t;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = test_on_chained_sigtrap;
+    sigemptyset(&action.sa_mask);
+    sigaddset(&action.sa_mask, SIGUSR1);
+
+    // INFO(Rafael): Traps raised by us while another thread probes are chained to the old handler, it must
+    //               run as if the kernel had called it straight.
+    action.sa_flags = SA_NODEFER;
+    sigaction(SIGTRAP, &action, NULL);
+    __atomic_store_n(&g_test_selftrap_prober_should_exit, 0, __ATOMIC_RELAXED);
+    if (pthread_create(&prober, NULL, test_selftrap_prober, NULL) != 0) {
+        return 1;
+    }
+    for (t = 0; t < 2000; t++) {
+        raise(SIGTRAP);
+    }
+    __atomic_store_n(&g_test_selftrap_prober_should_exit, 1, __ATOMIC_RELAXED);
+    pthread_join(prober, NULL);
+    if (g_test_chained_traps_nr != 2000 || g_test_chained_mask_is_wrong) {
+        return 1;
+    }
+
+    action.sa_flags = SA_NODEFER | SA_RESETHAND;
+    for (t = 0; t < 1000; t++) {
+        sigaction(SIGTRAP, &action, NULL);
+        __atomic_store_n(&g_test_selftrap_prober_should_exit, 0, __ATOMIC_RELAXED);
+        if (pthread_create(&prober, NULL, test_selftrap_prober, NULL) != 0) {
+            return 1;
+        }
+        raise(SIGTRAP);
+        __atomic_store_n(&g_test_selftrap_prober_should_exit, 1, __ATOMIC_RELAXED);
+        pthread_join(prober, NULL);
+        sigaction(SIGTRAP, NULL, &current);
+        if (current.sa_handler != SIG_DFL) {
+            return 1;
+        }
+    }
+
+    return (g_test_chained_traps_nr != 3000 || g_test_chained_mask_is_wrong);
+}
+
+CUTE_TEST_CASE(aegis_selftrap_chaining_tests)
+    pid_t pid;
+    int status = 0;
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTIC_SELFTRAP) == 0);
+    fflush(stdout);
+    pid = fork();
+    CUTE_ASSERT(pid != -1);
+    if (pid == 0) {
+        _exit(test_selftrap_chaining());
+    }
+    CUTE_ASSERT(waitpid(pid, &status, 0) == pid);
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTIC_PROCFS) == 0);
+    CUTE_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+CUTE_TEST_CASE_END
+
+static void test_write_fake_stat(const char *filepath, const char *comm, const char state) {
+    FILE *fp = fopen(filepath, "wb");
+    if (fp != NULL) {
+        fprintf(fp, "%d (%s) %c 1 %d %d 0 -1 4194560 0 0 0 0 0 0 0 0 20 0 1 0 42\n",
+                getpid(), comm, state, getpid(), getpid());
+        fclose(fp);
+    }
+}
+
+CUTE_TEST_CASE(aegis_procfs_root_tests)
+    char pid_dir[64], stat_path[128];
+    snprintf(pid_dir, sizeof(pid_dir), "procfs-test/%d", getpid());
+    snprintf(stat_path, sizeof(stat_path), "%s/stat", pid_dir);
+    CUTE_ASSERT(aegis_set_procfs_root("") != 0);
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTIC_PROCFS) == 0);
+    mkdir("procfs-test", 0755);
+    mkdir(pid_dir, 0755);
+    CUTE_ASSERT(aegis_set_procfs_root("procfs-test") == 0);
+    test_write_fake_stat(stat_path, "test", 't');
+    CUTE_ASSERT(aegis_has_debugger() == 1);
+    // INFO(Rafael): A comm faking a traced state must not fool us.
+    test_write_fake_stat(stat_path, "a) t (b", 'R');
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    CUTE_ASSERT(aegis_set_procfs_root(NULL) == 0);
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    remove(stat_path);
+    rmdir(pid_dir);
+    rmdir("procfs-test");
+CUTE_TEST_CASE_END
+
+static void test_write_fake_lineage(const pid_t pid, const char *comm, const pid_t ppid) {
+    char filepath[128];
+    FILE *fp;
+    snprintf(filepath, sizeof(filepath), "procfs-test/%d", pid);
+    mkdir(filepath, 0755);
+    snprintf(filepath, sizeof(filepath), "procfs-test/%d/stat", pid);
+    if ((fp = fopen(filepath, "wb")) != NULL) {
+        fprintf(fp, "%d (%s) S %d %d %d 0 -1 4194560 0 0 0 0 0 0 0 0 20 0 1 0 %d\n", pid, comm, ppid, pid, pid, pid * 3);
+        fclose(fp);
+    }
+}
+
+static void test_remove_fake_lineage(const pid_t pid) {
+    char filepath[128];
+    snprintf(filepath, sizeof(filepath), "procfs-test/%d/stat", pid);
+    remove(filepath);
+    snprintf(filepath, sizeof(filepath), "procfs-test/%d", pid);
+    rmdir(filepath);
+}
+
+CUTE_TEST_CASE(aegis_ancestry_tests)
+    pid_t ppid = getppid();
+    mkdir("procfs-test", 0755);
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTIC_ANCESTRY) == 0);
+    // INFO(Rafael): Fake lineage has no exe links, it is all about comm. Our parent was launched by gdb.
+    test_write_fake_lineage(ppid, "sh", 4242);
+    test_write_fake_lineage(4242, "gdb-multiarch", 1);
+    test_write_fake_lineage(1, "init", 0);
+    CUTE_ASSERT(aegis_set_procfs_root("procfs-test") == 0);
+    CUTE_ASSERT(aegis_has_debugger() == 1);
+    test_write_fake_lineage(4242, "gdbus", 1);
+    CUTE_ASSERT(aegis_has_debugger() == 1);
+    CUTE_ASSERT(aegis_set_procfs_root("procfs-test") == 0);
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    test_write_fake_lineage(4242, "a) strace (b", 1);
+    CUTE_ASSERT(aegis_set_procfs_root("procfs-test") == 0);
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    CUTE_ASSERT(aegis_set_procfs_root(NULL) == 0);
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTIC_PROCFS) == 0);
+    test_remove_fake_lineage(1);
+    test_remove_fake_lineage(4242);
+    test_remove_fake_lineage(ppid);
+    rmdir("procfs-test");
+CUTE_TEST_CASE_END
+
+static void test_write_file(const char *filepath, const char *data) {
+    FILE *fp = fopen(filepath, "wb");
+    if (fp != NULL) {
+        fputs(data, fp);
+        fclose(fp);
+    }
+}
+
+static int test_replace_file(const char *filepath, const char *data) {
+    char new_filepath[256];
+    snprintf(new_filepath, sizeof(new_filepath), "%s.new", filepath);
+    test_write_file(new_filepath, data);
+    return rename(new_filepath, filepath);
+}
+
+static int test_parse_config(const char *data, struct aegis_config *config) {
+    test_write_file("config-test/parse.conf", data);
+    return aegis_config_parse("config-test/parse.conf", config);
+}
+
+CUTE_TEST_CASE(aegis_config_parse_tests)
+    struct aegis_config config;
+    CUTE_ASSERT(aegis_config_parse("config-test/not-there.conf", &config) != 0);
+    CUTE_ASSERT(test_parse_config("", &config) == 0);
+    CUTE_ASSERT(config.gorgon_active_usecs == 0 && config.gorgon_idle_usecs == 0);
+    CUTE_ASSERT(config.heuristics == AEGIS_CONFIG_HEURISTICS_UNSET);
+    CUTE_ASSERT(config.on_debugger == AEGIS_CONFIG_ON_DEBUGGER_CALLBACK);
+    CUTE_ASSERT(test_parse_config("# INFO(Rafael): Comment.\n\n  gorgon_active_usecs = 1000  \n"
+                                  "gorgon_idle_usecs=sleep\nheuristics = procfs, ancestry\non_debugger = exit\n",
+                                  &config) == 0);
+    CUTE_ASSERT(config.gorgon_active_usecs == 1000);
+    CUTE_ASSERT(config.gorgon_idle_usecs == AEGIS_GORGON_SLEEP_WHEN_IDLE);
+    CUTE_ASSERT(config.heuristics == (AEGIS_HEURISTIC_PROCFS | AEGIS_HEURISTIC_ANCESTRY));
+    CUTE_ASSERT(config.on_debugger == AEGIS_CONFIG_ON_DEBUGGER_EXIT);
+    CUTE_ASSERT(test_parse_config("gorgon_idle_usecs = 5000\nheuristics = none\non_debugger = abort", &config) == 0);
+    CUTE_ASSERT(config.gorgon_idle_usecs == 5000 && config.heuristics == 0);
+    CUTE_ASSERT(config.on_debugger == AEGIS_CONFIG_ON_DEBUGGER_ABORT);
+    CUTE_ASSERT(test_parse_config("heuristics = selftrap\non_debugger = ignore\n", &config) == 0);
+    CUTE_ASSERT(config.heuristics == AEGIS_HEURISTIC_SELFTRAP);
+    CUTE_ASSERT(config.on_debugger == AEGIS_CONFIG_ON_DEBUGGER_IGNORE);
+    CUTE_ASSERT(test_parse_config("gorgon_active_usecs = 0\n", &config) != 0);
+    CUTE_ASSERT(test_parse_config("gorgon_active_usecs = -1\n", &config) != 0);
+    CUTE_ASSERT(test_parse_config("gorgon_active_usecs = 10ms\n", &config) != 0);
+    CUTE_ASSERT(test_parse_config("gorgon_active_usecs = 99999999999\n", &config) != 0);
+    CUTE_ASSERT(test_parse_config("gorgon_idle_usecs = forever\n", &config) != 0);
+    CUTE_ASSERT(test_parse_config("heuristics = procfs,gdb\n", &config) != 0);
+    CUTE_ASSERT(test_parse_config("heuristics =\n", &config) != 0);
+    CUTE_ASSERT(test_parse_config("on_debugger = panic\n", &config) != 0);
+    CUTE_ASSERT(test_parse_config("on_debuger = exit\n", &config) != 0);
+    CUTE_ASSERT(test_parse_config("on_debugger exit\n", &config) != 0);
+    CUTE_ASSERT(config.heuristics == AEGIS_HEURISTIC_SELFTRAP);
+    CUTE_ASSERT(config.on_debugger == AEGIS_CONFIG_ON_DEBUGGER_IGNORE);
+    remove("config-test/parse.conf");
+CUTE_TEST_CASE_END
+
+static int test_wait_config_on_debugger(const int on_debugger) {
+    size_t t;
+    for (t = 0; t < 100 && aegis_config_get()->on_debugger != on_debugger; t++) {
+        usleep(10000);
+    }
+    return (aegis_config_get()->on_debugger == on_debugger);
+}
+
+CUTE_TEST_CASE(aegis_config_reload_tests)
+    const struct aegis_config *config;
+    CUTE_ASSERT(aegis_config_get()->on_debugger == AEGIS_CONFIG_ON_DEBUGGER_CALLBACK);
+    test_write_file("config-test/aegis.conf", "on_debugger = ignore\ngorgon_active_usecs = 2000\n");
+    CUTE_ASSERT(test_wait_config_on_debugger(AEGIS_CONFIG_ON_DEBUGGER_IGNORE));
+    config = aegis_config_get();
+    CUTE_ASSERT(config->gorgon_active_usecs == 2000);
+    // INFO(Rafael): Broken, emptied or saved unchanged, nothing is published.
+    CUTE_ASSERT(test_replace_file("config-test/aegis.conf", "on_debugger = panic\n") == 0);
+    CUTE_ASSERT(test_replace_file("config-test/aegis.conf", "gorgon_active_usecs = 2000\non_debugger = ignore\n") == 0);
+    test_write_file("config-test/aegis.conf", "");
+    usleep(100000);
+    CUTE_ASSERT(aegis_config_get() == config);
+    CUTE_ASSERT(test_replace_file("config-test/aegis.conf", "# Defaults.\n") == 0);
+    CUTE_ASSERT(test_wait_config_on_debugger(AEGIS_CONFIG_ON_DEBUGGER_CALLBACK));
+    CUTE_ASSERT(aegis_config_get()->gorgon_active_usecs == 0);
+    CUTE_ASSERT(config->on_debugger == AEGIS_CONFIG_ON_DEBUGGER_IGNORE && config->gorgon_active_usecs == 2000);
+    remove("config-test/aegis.conf");
+CUTE_TEST_CASE_END
+
+CUTE_TEST_CASE(aegis_daemon_attach_tests)
+    const char *socket_path = "aegisd-test.sock";
+    pid_t pid;
+    CUTE_ASSERT(aegis_daemon_attach(socket_path) != 0);
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    pid = fork();
+    if (pid == 0) {
+        execl("../../bin/aegisd", "aegisd", "--socket=aegisd-test.sock", "--board=/aegisd-test-board", NULL);
+        exit(1);
+    }
+    CUTE_ASSERT(pid != -1);
+    sleep(TEST_SLEEP_IN_SECS);
+    CUTE_ASSERT(aegis_daemon_attach(socket_path) == 0);
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    sleep(TEST_SLEEP_IN_SECS);
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    aegis_daemon_detach();
+    remove(socket_path);
+CUTE_TEST_CASE_END
+
+CUTE_TEST_CASE(aegis_daemon_verdict_tests)
+    const char *socket_path = "aegisd-test.sock";
+    char pid_dir[64], stat_path[128];
+    pid_t pid;
+    size_t t;
+    snprintf(pid_dir, sizeof(pid_dir), "daemon-procfs-test/%d", getpid());
+    snprintf(stat_path, sizeof(stat_path), "%s/stat", pid_dir);
+    mkdir("daemon-procfs-test", 0755);
+    mkdir(pid_dir, 0755);
+    test_write_fake_stat(stat_path, "test", 't');
+    // INFO(Rafael): We do not probe by ourselves, whatever is detected here comes from aegisd.
+    CUTE_ASSERT(aegis_set_heuristics(0) == 0);
+    pid = fork();
+    if (pid == 0) {
+        execl("../../bin/aegisd", "aegisd", "--socket=aegisd-test.sock", "--board=/aegisd-test-board",
+              "--procfs-root=daemon-procfs-test", NULL);
+        exit(1);
+    }
+    CUTE_ASSERT(pid != -1);
+    sleep(TEST_SLEEP_IN_SECS);
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    CUTE_ASSERT(aegis_daemon_attach(socket_path) == 0);
+    CUTE_ASSERT(aegis_has_debugger() == 1);
+    test_write_fake_stat(stat_path, "test", 'S');
+    for (t = 0; t < 100 && aegis_has_debugger() != 0; t++) {
+        usleep(10000);
+    }
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    test_write_fake_stat(stat_path, "test", 't');
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    sleep(TEST_SLEEP_IN_SECS);
+    CUTE_ASSERT(aegis_has_debugger() == 0);
+    pid = fork();
+    if (pid == 0) {
+        execl("../../bin/aegisd", "aegisd", "--socket=aegisd-test.sock", "--board=/aegisd-test-board",
+              "--procfs-root=daemon-procfs-test", NULL);
+        exit(1);
+    }
+    CUTE_ASSERT(pid != -1);
+    for (t = 0; t < 300 && aegis_has_debugger() != 1; t++) {
+        usleep(10000);
+    }
+    CUTE_ASSERT(aegis_has_debugger() == 1);
+    aegis_daemon_detach();
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTIC_PROCFS) == 0);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    remove(socket_path);
+    remove(stat_path);
+    rmdir(pid_dir);
+    rmdir("daemon-procfs-test");
+CUTE_TEST_CASE_END
+
+#endif
+
 static FILE *gdb(void) {
     return popen("gdb", "w");
 }
@@ -478,6 +878,355 @@ CUTE_TEST_CASE_END
 
 #endif
 
+#if defined(__linux__)
+
+static void *test_fake_tracer(void *args) {
+    char stat_path[128], status_path[128];
+    snprintf(stat_path, sizeof(stat_path), "%s/stat", (const char *)args);
+    snprintf(status_path, sizeof(status_path), "%s/status", (const char *)args);
+    usleep(200000);
+    test_write_fake_stat(stat_path, "test", 't');
+    test_write_file(status_path, "Name:\ttest\nState:\tt (tracing stop)\nTracerPid:\t1\n");
+    return NULL;
+}
+
+#endif
+
+CUTE_TEST_CASE(aegis_wait_for_debugger_tests)
+    time_t t0 = time(NULL);
+#if defined(__linux__)
+    char pid_dir[64], stat_path[128], status_path[128];
+    pthread_t tracer;
+#endif
+    CUTE_ASSERT(aegis_wait_for_debugger(0) == 0);
+    CUTE_ASSERT(aegis_wait_for_debugger(2000) == 0);
+    CUTE_ASSERT((time(NULL) - t0) >= 1);
+#if defined(__linux__)
+    snprintf(pid_dir, sizeof(pid_dir), "wait-procfs-test/%d", getpid());
+    snprintf(stat_path, sizeof(stat_path), "%s/stat", pid_dir);
+    snprintf(status_path, sizeof(status_path), "%s/status", pid_dir);
+    mkdir("wait-procfs-test", 0755);
+    mkdir(pid_dir, 0755);
+    test_write_fake_stat(stat_path, "test", 'S');
+    test_write_file(status_path, "Name:\ttest\nState:\tS (sleeping)\nTracerPid:\t0\n");
+    CUTE_ASSERT(aegis_set_heuristics(AEGIS_HEURISTIC_PROCFS) == 0);
+    CUTE_ASSERT(aegis_set_procfs_root("wait-procfs-test") == 0);
+    CUTE_ASSERT(pthread_create(&tracer, NULL, test_fake_tracer, pid_dir) == 0);
+    t0 = time(NULL);
+    CUTE_ASSERT(aegis_wait_for_debugger(10000) == 1);
+    CUTE_ASSERT((time(NULL) - t0) <= 2);
+    pthread_join(tracer, NULL);
+    CUTE_ASSERT(aegis_set_procfs_root(NULL) == 0);
+    remove(stat_path);
+    remove(status_path);
+    rmdir(pid_dir);
+    rmdir("wait-procfs-test");
+#endif
+CUTE_TEST_CASE_END
+
+#if !defined(_WIN32)
+
+static int g_test_gorgon_loops_nr = 0;
+
+static int g_test_gorgon_should_exit = 0;
+
+static int g_test_gorgon_exits_nr = 0;
+
+static int test_count_gorgon_loops(void *args) {
+    __atomic_fetch_add(&g_test_gorgon_loops_nr, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&g_test_gorgon_should_exit, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&g_test_gorgon_exits_nr, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+static void test_ignore_debugger(void *args) {
+}
+
+static int test_wait_gorgon_loops(const int loops_nr) {
+    size_t t;
+    for (t = 0; t < 100 && __atomic_load_n(&g_test_gorgon_loops_nr, __ATOMIC_RELAXED) < loops_nr; t++) {
+        usleep(10000);
+    }
+    return (__atomic_load_n(&g_test_gorgon_loops_nr, __ATOMIC_RELAXED) >= loops_nr);
+}
+
+static int test_wait_gorgon_exits(const int exits_nr) {
+    size_t t;
+    for (t = 0; t < 100 && __atomic_load_n(&g_test_gorgon_exits_nr, __ATOMIC_RELAXED) < exits_nr; t++) {
+        usleep(10000);
+    }
+    return (__atomic_load_n(&g_test_gorgon_exits_nr, __ATOMIC_RELAXED) >= exits_nr);
+}
+
+#endif
+
+CUTE_TEST_CASE(aegis_protect_tests)
+#if !defined(_WIN32)
+    struct aegis_probe_stats before, after;
+#endif
+    CUTE_ASSERT(aegis_set_gorgon_probe_rate(0, 1) != 0);
+    CUTE_ASSERT(aegis_set_gorgon_probe_rate(1, 0) != 0);
+    CUTE_ASSERT(aegis_set_gorgon_probe_rate(100, AEGIS_GORGON_SLEEP_WHEN_IDLE) == 0);
+    aegis_protect_begin();
+    aegis_protect_begin();
+    aegis_protect_end();
+    aegis_protect_end();
+#if !defined(_WIN32)
+    __atomic_store_n(&g_test_gorgon_should_exit, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_test_gorgon_loops_nr, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_test_gorgon_exits_nr, 0, __ATOMIC_RELAXED);
+    CUTE_ASSERT(aegis_set_gorgon_probe_rate(1000, AEGIS_GORGON_SLEEP_WHEN_IDLE) == 0);
+    aegis_get_gorgon_stats(&before);
+    CUTE_ASSERT(aegis_set_gorgon(test_count_gorgon_loops, NULL, test_ignore_debugger, NULL) == 0);
+    CUTE_ASSERT(test_wait_gorgon_loops(3));
+    aegis_get_gorgon_stats(&after);
+    CUTE_ASSERT(after.probes_nr == before.probes_nr);
+    aegis_protect_begin();
+    usleep(100000);
+    aegis_get_gorgon_stats(&after);
+    CUTE_ASSERT(after.probes_nr > before.probes_nr);
+    CUTE_ASSERT(after.last_nsecs <= after.max_nsecs);
+    CUTE_ASSERT(after.max_nsecs <= after.total_nsecs);
+    aegis_protect_end();
+    usleep(20000);
+    aegis_get_gorgon_stats(&before);
+    usleep(300000);
+    aegis_get_gorgon_stats(&after);
+    CUTE_ASSERT(after.probes_nr == before.probes_nr);
+    __atomic_store_n(&g_test_gorgon_should_exit, 1, __ATOMIC_RELAXED);
+    aegis_wake_gorgon();
+    CUTE_ASSERT(test_wait_gorgon_exits(1));
+#endif
+    CUTE_ASSERT(aegis_set_gorgon_probe_rate(1, 1) == 0);
+CUTE_TEST_CASE_END
+
+#if !defined(_WIN32)
+
+CUTE_TEST_CASE(aegis_wipe_secrets_tests)
+    static unsigned char secret[(16 << 20) + 7];
+    struct aegis_wipe_stats stats;
+    size_t s;
+    CUTE_ASSERT(aegis_register_secret(NULL, 1) != 0);
+    CUTE_ASSERT(aegis_register_secret(secret, 0) != 0);
+    CUTE_ASSERT(aegis_unregister_secret(secret) != 0);
+    CUTE_ASSERT(aegis_set_wipe_workers(65) != 0);
+    CUTE_ASSERT(aegis_set_wipe_workers(2) == 0);
+    memset(secret, 0x5A, sizeof(secret));
+    CUTE_ASSERT(aegis_register_secret(secret, sizeof(secret)) == 0);
+    aegis_wipe_secrets();
+    for (s = 0; s < sizeof(secret) && secret[s] == 0; s++)
+        ;
+    CUTE_ASSERT(s == sizeof(secret));
+    aegis_get_wipe_stats(&stats);
+    CUTE_ASSERT(stats.wipes_nr >= 1);
+    CUTE_ASSERT(stats.wiped_bytes == sizeof(secret));
+    CUTE_ASSERT(stats.last_nsecs <= stats.max_nsecs);
+    memset(secret, 0x5A, sizeof(secret));
+    aegis_wipe_secrets();
+    CUTE_ASSERT(secret[0] == 0 && secret[sizeof(secret) - 1] == 0);
+    aegis_get_wipe_stats(&stats);
+    CUTE_ASSERT(stats.wipes_nr >= 2);
+    CUTE_ASSERT(aegis_unregister_secret(secret) == 0);
+    CUTE_ASSERT(aegis_unregister_secret(secret) != 0);
+CUTE_TEST_CASE_END
+
+static int g_test_wiper_should_exit = 0;
+
+static void *test_wiper(void *args) {
+    while (!__atomic_load_n(&g_test_wiper_should_exit, __ATOMIC_RELAXED)) {
+        aegis_wipe_secrets();
+    }
+    return NULL;
+}
+
+CUTE_TEST_CASE(aegis_unregister_secret_tests)
+    pthread_t wiper;
+    unsigned char *secret;
+    size_t t;
+    CUTE_ASSERT(aegis_set_wipe_workers(2) == 0);
+    __atomic_store_n(&g_test_wiper_should_exit, 0, __ATOMIC_RELAXED);
+    CUTE_ASSERT(pthread_create(&wiper, NULL, test_wiper, NULL) == 0);
+    // INFO(Rafael): Once unregistered, memory is ours again, no wipe may be running on it.
+    for (t = 0; t < 200; t++) {
+        secret = (unsigned char *)malloc(9 << 20);
+        CUTE_ASSERT(secret != NULL);
+        CUTE_ASSERT(aegis_register_secret(secret, 9 << 20) == 0);
+        usleep(100);
+        CUTE_ASSERT(aegis_unregister_secret(secret) == 0);
+        memset(secret, 0x5A, 9 << 20);
+        CUTE_ASSERT(secret[0] == 0x5A && secret[(9 << 20) - 1] == 0x5A);
+        free(secret);
+    }
+    __atomic_store_n(&g_test_wiper_should_exit, 1, __ATOMIC_RELAXED);
+    pthread_join(wiper, NULL);
+CUTE_TEST_CASE_END
+
+static int g_test_stalls_nr = 0;
+
+static unsigned int g_test_on_stall_usecs = 0;
+
+static void test_on_stall(void *args) {
+    unsigned int usecs = __atomic_load_n(&g_test_on_stall_usecs, __ATOMIC_RELAXED);
+    if (usecs > 0) {
+        usleep(usecs);
+    }
+    __atomic_fetch_add((int *)args, 1, __ATOMIC_RELAXED);
+}
+
+static int g_test_stop_from_stall = -1;
+
+static void test_stop_on_stall(void *args) {
+    __atomic_store_n((int *)args, aegis_stop_heartbeat_monitors(), __ATOMIC_RELAXED);
+}
+
+CUTE_TEST_CASE(aegis_heartbeat_tests)
+    struct aegis_heartbeat *heartbeat;
+    size_t b;
+    CUTE_ASSERT(aegis_heartbeat_register(0) == NULL);
+    CUTE_ASSERT(aegis_set_heartbeat_monitors(0, 1000, NULL, NULL) != 0);
+    CUTE_ASSERT(aegis_set_heartbeat_monitors(1, 0, NULL, NULL) != 0);
+    heartbeat = aegis_heartbeat_register(1000000);
+    CUTE_ASSERT(heartbeat != NULL);
+    CUTE_ASSERT(aegis_set_heartbeat_monitors(2, 1000, test_on_stall, &g_test_stalls_nr) == 0);
+    CUTE_ASSERT(aegis_set_heartbeat_monitors(2, 1000, test_on_stall, &g_test_stalls_nr) != 0);
+    for (b = 0; b < 100; b++) {
+        aegis_heartbeat_beat(heartbeat);
+        usleep(1000);
+    }
+    CUTE_ASSERT(__atomic_load_n(&g_test_stalls_nr, __ATOMIC_RELAXED) == 0);
+    aegis_heartbeat_unregister(heartbeat);
+    // INFO(Rafael): A heartbeat that stops beating must be reported once. A slow on_stall must not make
+    //               the monitor running it look stalled to its neighbour.
+    __atomic_store_n(&g_test_on_stall_usecs, 600000, __ATOMIC_RELAXED);
+    heartbeat = aegis_heartbeat_register(1000);
+    CUTE_ASSERT(heartbeat != NULL);
+    for (b = 0; b < 50 && __atomic_load_n(&g_test_stalls_nr, __ATOMIC_RELAXED) == 0; b++) {
+        usleep(100000);
+    }
+    sleep(TEST_SLEEP_IN_SECS * 2);
+    aegis_heartbeat_unregister(heartbeat);
+    __atomic_store_n(&g_test_on_stall_usecs, 0, __ATOMIC_RELAXED);
+    CUTE_ASSERT(__atomic_load_n(&g_test_stalls_nr, __ATOMIC_RELAXED) == 1);
+    CUTE_ASSERT(aegis_stop_heartbeat_monitors() == 0);
+    CUTE_ASSERT(aegis_stop_heartbeat_monitors() == 0);
+    CUTE_ASSERT(aegis_set_heartbeat_monitors(1, 1000, test_on_stall, &g_test_stalls_nr) == 0);
+    CUTE_ASSERT(aegis_stop_heartbeat_monitors() == 0);
+    CUTE_ASSERT(aegis_set_heartbeat_monitors(1, 1000, test_stop_on_stall, &g_test_stop_from_stall) == 0);
+    heartbeat = aegis_heartbeat_register(1000);
+    CUTE_ASSERT(heartbeat != NULL);
+    for (b = 0; b < 50 && __atomic_load_n(&g_test_stop_from_stall, __ATOMIC_RELAXED) == -1; b++) {
+        usleep(100000);
+    }
+    aegis_heartbeat_unregister(heartbeat);
+    CUTE_ASSERT(__atomic_load_n(&g_test_stop_from_stall, __ATOMIC_RELAXED) == 1);
+    CUTE_ASSERT(aegis_stop_heartbeat_monitors() == 0);
+CUTE_TEST_CASE_END
+
+static int g_test_stall_runners_nr = 0;
+
+static int g_test_stalls_did_overlap = 0;
+
+static void test_on_lasting_stall(void *args) {
+    if (__atomic_fetch_add(&g_test_stall_runners_nr, 1, __ATOMIC_SEQ_CST) != 0) {
+        __atomic_store_n(&g_test_stalls_did_overlap, 1, __ATOMIC_RELAXED);
+    }
+    usleep(500000);
+    __atomic_fetch_sub(&g_test_stall_runners_nr, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add((int *)args, 1, __ATOMIC_RELAXED);
+}
+
+CUTE_TEST_CASE(aegis_dispatch_tests)
+    struct aegis_heartbeat *heartbeat, *late_heartbeat;
+    struct aegis_dispatch_stats stats;
+    unsigned long long coalesced_nr;
+    size_t t;
+    CUTE_ASSERT(aegis_set_gorgon_dispatch(AEGIS_DISPATCH_ASYNC + 1, 0) != 0);
+    CUTE_ASSERT(aegis_set_gorgon_dispatch(AEGIS_DISPATCH_ASYNC, 1) != 0);
+    CUTE_ASSERT(aegis_set_gorgon_dispatch(AEGIS_DISPATCH_ASYNC, 0) == 0);
+    __atomic_store_n(&g_test_stalls_nr, 0, __ATOMIC_RELAXED);
+    CUTE_ASSERT(aegis_set_heartbeat_monitors(2, 1000, test_on_stall, &g_test_stalls_nr) == 0);
+    heartbeat = aegis_heartbeat_register(1000);
+    CUTE_ASSERT(heartbeat != NULL);
+    for (t = 0; t < 50 && __atomic_load_n(&g_test_stalls_nr, __ATOMIC_RELAXED) == 0; t++) {
+        usleep(100000);
+    }
+    aegis_heartbeat_unregister(heartbeat);
+    CUTE_ASSERT(__atomic_load_n(&g_test_stalls_nr, __ATOMIC_RELAXED) > 0);
+    aegis_get_dispatch_stats(&stats);
+    CUTE_ASSERT(stats.dispatches_nr > 0);
+    CUTE_ASSERT(stats.last_nsecs <= stats.max_nsecs);
+    CUTE_ASSERT(stats.max_nsecs <= stats.total_nsecs);
+    CUTE_ASSERT(aegis_stop_heartbeat_monitors() == 0);
+    // INFO(Rafael): Going synchronous while the responder runs a callback must not run it twice at once.
+    __atomic_store_n(&g_test_stalls_nr, 0, __ATOMIC_RELAXED);
+    CUTE_ASSERT(aegis_set_heartbeat_monitors(2, 1000, test_on_lasting_stall, &g_test_stalls_nr) == 0);
+    heartbeat = aegis_heartbeat_register(1000);
+    CUTE_ASSERT(heartbeat != NULL);
+    for (t = 0; t < 50 && __atomic_load_n(&g_test_stall_runners_nr, __ATOMIC_SEQ_CST) == 0; t++) {
+        usleep(10000);
+    }
+    CUTE_ASSERT(__atomic_load_n(&g_test_stall_runners_nr, __ATOMIC_SEQ_CST) == 1);
+    aegis_get_dispatch_stats(&stats);
+    coalesced_nr = stats.coalesced_nr;
+    CUTE_ASSERT(aegis_set_gorgon_dispatch(AEGIS_DISPATCH_SYNC, 0) == 0);
+    late_heartbeat = aegis_heartbeat_register(1000);
+    CUTE_ASSERT(late_heartbeat != NULL);
+    usleep(200000);
+    aegis_heartbeat_unregister(late_heartbeat);
+    aegis_heartbeat_unregister(heartbeat);
+    for (t = 0; t < 100 && __atomic_load_n(&g_test_stall_runners_nr, __ATOMIC_SEQ_CST) != 0; t++) {
+        usleep(10000);
+    }
+    aegis_get_dispatch_stats(&stats);
+    CUTE_ASSERT(stats.coalesced_nr > coalesced_nr);
+    CUTE_ASSERT(__atomic_load_n(&g_test_stalls_did_overlap, __ATOMIC_RELAXED) == 0);
+    CUTE_ASSERT(aegis_stop_heartbeat_monitors() == 0);
+CUTE_TEST_CASE_END
+
+CUTE_TEST_CASE(aegis_atfork_tests)
+    static unsigned char secret[8 << 20];
+    struct aegis_wipe_stats stats;
+    pid_t pid;
+    int status = 0;
+    CUTE_ASSERT(aegis_set_wipe_workers(2) == 0);
+    memset(secret, 0x5A, sizeof(secret));
+    CUTE_ASSERT(aegis_register_secret(secret, sizeof(secret)) == 0);
+    aegis_wipe_secrets();
+    CUTE_ASSERT(aegis_set_gorgon_probe_rate(1000, 1000) == 0);
+    __atomic_store_n(&g_test_gorgon_should_exit, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_test_gorgon_loops_nr, 0, __ATOMIC_RELAXED);
+    CUTE_ASSERT(aegis_set_gorgon(test_count_gorgon_loops, NULL, test_ignore_debugger, NULL) == 0);
+    CUTE_ASSERT(test_wait_gorgon_loops(1));
+    fflush(stdout);
+    pid = fork();
+    CUTE_ASSERT(pid != -1);
+    if (pid == 0) {
+        // INFO(Rafael): Nothing is spawned by forking, the gorgon only comes back on our first call.
+        __atomic_store_n(&g_test_gorgon_loops_nr, 0, __ATOMIC_RELAXED);
+        usleep(50000);
+        status = (__atomic_load_n(&g_test_gorgon_loops_nr, __ATOMIC_RELAXED) == 0);
+        status = status && (aegis_has_debugger() == 0);
+        status = status && test_wait_gorgon_loops(2);
+        aegis_get_wipe_stats(&stats);
+        status = status && (stats.wipes_nr == 0);
+        memset(secret, 0x5A, sizeof(secret));
+        aegis_wipe_secrets();
+        aegis_get_wipe_stats(&stats);
+        status = status && (stats.wipes_nr == 1) && (secret[0] == 0) && (secret[sizeof(secret) - 1] == 0);
+        _exit(status ? 0 : 1);
+    }
+    CUTE_ASSERT(waitpid(pid, &status, 0) == pid);
+    __atomic_store_n(&g_test_gorgon_should_exit, 1, __ATOMIC_RELAXED);
+    CUTE_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CUTE_ASSERT(aegis_unregister_secret(secret) == 0);
+    usleep(10000);
+    CUTE_ASSERT(aegis_set_gorgon_probe_rate(1, 1) == 0);
+CUTE_TEST_CASE_END
+
+#endif
+
 static int has_gdb(void) {
 #if defined(__unix__)
     return (system("gdb --version > /dev/null 2>&1") == 0);